@@ -33,9 +33,14 @@
 */
 
 // manual changes: replaced unsafe / wrong types with correct ones, e.g. unsigned long with uint32_t
+// added mt_state and the mt_ functions that take it, the old functions use a global state; the next N words are generated with SSE2 if possible
 // file comes from https://github.com/notr1ch/opentdm/blob/master/mt19937.c
 
 #include <stdio.h>
+#include <stdint.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /* Period parameters */
 #define N 624
@@ -44,12 +49,22 @@
 #define UPPER_MASK 0x80000000UL /* most significant w-r bits */
 #define LOWER_MASK 0x7fffffffUL /* least significant r bits */
 
-static uint32_t mt[N]; /* the array for the state vector  */
-static int mti=N+1; /* mti==N+1 means mt[N] is not initialized */
+/* the whole state of one generator, so several of them can be used at the same time (e.g. from different threads) */
+struct _mt_state {
+    uint32_t mt[N]; /* the array for the state vector  */
+    int mti; /* mti==N+1 means mt[N] is not initialized */
+};
+
+typedef struct _mt_state mt_state;
+
+/* the state used by the functions without an mt_state argument */
+static mt_state global_state = {{0}, N+1};
 
 /* initializes mt[N] with a seed */
-void init_genrand(uint32_t s)
+void mt_init_genrand(mt_state *state, uint32_t s)
 {
+    uint32_t *mt = state->mt;
+    int mti;
     mt[0]= s & 0xffffffffUL;
     for (mti=1; mti<N; mti++) {
         mt[mti] =
@@ -61,16 +76,18 @@ void init_genrand(uint32_t s)
         mt[mti] &= 0xffffffffUL;
         /* for >32 bit machines */
     }
+    state->mti = mti;
 }
 
 /* initialize by an array with array-length */
 /* init_key is the array for initializing keys */
 /* key_length is its length */
 /* slight change for C++, 2004/2/26 */
-void init_by_array(uint32_t init_key[], int key_length)
+void mt_init_by_array(mt_state *state, uint32_t init_key[], int key_length)
 {
+    uint32_t *mt = state->mt;
     int i, j, k;
-    init_genrand(19650218UL);
+    mt_init_genrand(state, 19650218UL);
     i=1; j=0;
     k = (N>key_length ? N : key_length);
     for (; k; k--) {
@@ -92,34 +109,68 @@ void init_by_array(uint32_t init_key[], int key_length)
     mt[0] = 0x80000000UL; /* MSB is 1; assuring non-zero initial array */
 }
 
+#ifdef __SSE2__
+/* next state of the 4 words starting at mt[kk]; next is mt[kk+M] or mt[kk+(M-N)], which is always at least 4 words away */
+static inline void mt_generate_4_words(uint32_t *mt, int kk, const uint32_t *next)
+{
+    const __m128i upper_mask = _mm_set1_epi32(UPPER_MASK);
+    const __m128i lower_mask = _mm_set1_epi32(LOWER_MASK);
+    const __m128i one = _mm_set1_epi32(1);
+    const __m128i matrix_a = _mm_set1_epi32(MATRIX_A);
+
+    __m128i y = _mm_or_si128(_mm_and_si128(_mm_loadu_si128((const __m128i *) &mt[kk]), upper_mask),
+                             _mm_and_si128(_mm_loadu_si128((const __m128i *) &mt[kk+1]), lower_mask));
+    __m128i mag = _mm_and_si128(_mm_cmpeq_epi32(_mm_and_si128(y, one), one), matrix_a);
+    __m128i result = _mm_xor_si128(_mm_xor_si128(_mm_loadu_si128((const __m128i *) next), _mm_srli_epi32(y, 1)), mag);
+    _mm_storeu_si128((__m128i *) &mt[kk], result);
+}
+#endif
+
+/* generates the next N words at one time; the words only depend on ones that are at least N-M apart, so 4 go at once */
+void mt_generate_block(mt_state *state)
+{
+    uint32_t *mt = state->mt;
+    static const uint32_t mag01[2]={0x0UL, MATRIX_A};
+    uint32_t y;
+    int kk = 0;
+
+#ifdef __SSE2__
+    for (;kk+4<=N-M;kk+=4) {
+        mt_generate_4_words(mt, kk, &mt[kk+M]);
+    }
+#endif
+    for (;kk<N-M;kk++) {
+        y = (mt[kk]&UPPER_MASK)|(mt[kk+1]&LOWER_MASK);
+        mt[kk] = mt[kk+M] ^ (y >> 1) ^ mag01[y & 0x1UL];
+    }
+#ifdef __SSE2__
+    for (;kk+4<=N-1;kk+=4) {
+        mt_generate_4_words(mt, kk, &mt[kk+(M-N)]);
+    }
+#endif
+    for (;kk<N-1;kk++) {
+        y = (mt[kk]&UPPER_MASK)|(mt[kk+1]&LOWER_MASK);
+        mt[kk] = mt[kk+(M-N)] ^ (y >> 1) ^ mag01[y & 0x1UL];
+    }
+    y = (mt[N-1]&UPPER_MASK)|(mt[0]&LOWER_MASK);
+    mt[N-1] = mt[M-1] ^ (y >> 1) ^ mag01[y & 0x1UL];
+
+    state->mti = 0;
+}
+
 /* generates a random number on [0,0xffffffff]-interval */
-uint32_t genrand_int32(void)
+uint32_t mt_genrand_int32(mt_state *state)
 {
     uint32_t y;
-    static uint32_t mag01[2]={0x0UL, MATRIX_A};
-    /* mag01[x] = x * MATRIX_A  for x=0,1 */
-
-    if (mti >= N) { /* generate N words at one time */
-        int kk;
-
-        if (mti == N+1)   /* if init_genrand() has not been called, */
-            init_genrand(5489UL); /* a default initial seed is used */
-
-        for (kk=0;kk<N-M;kk++) {
-            y = (mt[kk]&UPPER_MASK)|(mt[kk+1]&LOWER_MASK);
-            mt[kk] = mt[kk+M] ^ (y >> 1) ^ mag01[y & 0x1UL];
-        }
-        for (;kk<N-1;kk++) {
-            y = (mt[kk]&UPPER_MASK)|(mt[kk+1]&LOWER_MASK);
-            mt[kk] = mt[kk+(M-N)] ^ (y >> 1) ^ mag01[y & 0x1UL];
-        }
-        y = (mt[N-1]&UPPER_MASK)|(mt[0]&LOWER_MASK);
-        mt[N-1] = mt[M-1] ^ (y >> 1) ^ mag01[y & 0x1UL];
-
-        mti = 0;
+
+    if (state->mti >= N) { /* generate N words at one time */
+        if (state->mti == N+1)   /* if init_genrand() has not been called, */
+            mt_init_genrand(state, 5489UL); /* a default initial seed is used */
+
+        mt_generate_block(state);
     }
 
-    y = mt[mti++];
+    y = state->mt[state->mti++];
 
     /* Tempering */
     y ^= (y >> 11);
@@ -130,6 +181,21 @@ uint32_t genrand_int32(void)
     return y;
 }
 
+void init_genrand(uint32_t s)
+{
+    mt_init_genrand(&global_state, s);
+}
+
+void init_by_array(uint32_t init_key[], int key_length)
+{
+    mt_init_by_array(&global_state, init_key, key_length);
+}
+
+uint32_t genrand_int32(void)
+{
+    return mt_genrand_int32(&global_state);
+}
+
 /* generates a random number on [0,0x7fffffff]-interval */
 int32_t genrand_int31(void)
 {
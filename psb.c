@@ -1,43 +1,81 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
 #include <ctype.h>
+#include <errno.h>
 #include <assert.h>
+#include <stddef.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <signal.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #include <zlib.h>
 #include <openssl/md5.h>
+#include <openssl/evp.h>
 
 #include "mt19937.c"
 
 int debug = 0; // use for debug outputs
 int debug_filewrites = 0; // use for debug file writes
-
-struct _type_value {
-    uint8_t type;
-    uint16_t value_length; // if value is an array, save its length here
-    union value {
-        struct _type_value *type_value_object;
-        struct _type_value **type_value_array;
-        struct _name_object **name_object_array;
-        uint32_t integer;
-        uint32_t *integer_array;
-        uint64_t long_integer;
-        float float_value;
-        double double_value;
-    } value;
+int thread_count = 0; // amount of worker threads, 0 means one per online cpu core
+_Thread_local int local_thread_count = 0; // overrides thread_count on the thread it's set on, e.g. for one of many jobs
+int use_snapshots = 0; // load the psb.m from its snapshot if there is a valid one, and write one if there isn't
+const char *cache_directory = NULL; // where compressed payloads get cached, NULL disables the cache
+uint64_t cache_size_limit = 1024 * 1024 * 1024; // the least recently used payloads get removed above this size
+
+#define NO_NODE UINT32_MAX
+
+// The entries of a psb as a flat table of nodes, stored as a structure of arrays. Node 0 is the root object.
+// The table is a lazy view of the uncompressed psb: nodes are only read once they are visited, and the children
+// of a type 32/33 node are only added (next to each other, behind their parent) when one of them is visited.
+// Use the psb_cursor functions to read nodes instead of accessing the arrays directly, they take care of that.
+struct _psb_nodes {
+    uint32_t amount;
+    uint32_t capacity;
+    uint8_t *types; // 0 if the node hasn't been read yet
+    uint64_t *values; // ints, string and chunk indexes, the bits of floats/doubles
+    uint32_t *lengths; // amount of entries of arrays of ints and of children of type 32/33
+    uint32_t *first_children; // index of the first child of type 32/33, NO_NODE if they haven't been added yet
+    uint32_t *name_indexes; // name of the node, if its parent is of type 33
+    uint32_t *parents;
+    const Byte **raw_data; // where the node was read from; as long as it isn't dirty, these raw bytes are packed instead
+    uint32_t *raw_sizes; // 0 if it hasn't been needed yet, see get_node_raw_size
 };
 
-struct _name_object {
-    uint32_t name_index;
-    struct _type_value *object;
-    char *name_string;
+// What the serializer needs for packing the entries of one injection, the node table itself isn't changed by packing
+struct _psb_pack_state {
+    uint8_t *dirty; // set by mark_dirty when the node or anything below it got modified
+    uint64_t *values; // new values of the modified int nodes
+    uint32_t *packed_sizes; // size of the packed node, set by the sizing pass of the serializer
+    uint8_t *packed_widths; // byte width of the array entries (or the offsets of type 32/33) when packing
+    uint8_t *packed_name_widths; // byte width of the name indexes of type 33 when packing
 };
 
 struct _file_info {
     uint32_t name_index;
-    uint64_t *offset; // pointer to the offset value in the psb_data struct
-    uint64_t *length; // pointer to the length value in the psb_data struct
+    uint32_t offset_node; // read these using get_file_info_offset / get_file_info_length, injections keep their own copies
+    uint32_t length_node;
 };
 
 struct _psb_header {
@@ -53,8 +91,18 @@ struct _psb_header {
 	uint32_t offset_entries;
 };
 
+// identifies the psb.m a psb_data was loaded from, see the snapshot functions
+struct _psb_source {
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint32_t crc; // crc32 of the whole file, only filled in for snapshots
+};
+
 // for easy re-packing
 struct _original_psb_data {
+    Byte *raw_psb; // the whole uncompressed psb, everything else points into it
+    uint32_t raw_psb_size;
     Byte *raw_names;
     uint32_t raw_names_size;
     Byte *raw_strings;
@@ -62,6 +110,7 @@ struct _original_psb_data {
 };
 
 struct _psb_data {
+    struct _arena *arena; // owns everything below
     struct _psb_header *header;
     char **names;
     uint32_t names_amount;
@@ -69,1023 +118,4692 @@ struct _psb_data {
     uint32_t strings_amount;
     Byte **chunkdata;
     uint32_t chunkdata_size;
-    struct _type_value *entries; // type 33
-    struct _file_info **file_info;
+    struct _psb_nodes entries; // node 0 is a type 33 object
+    struct _file_info *file_info;
     uint32_t file_info_amount;
-    Byte **subfile_data;
+    uint32_t *file_info_slots; // hash map from name to file_info index + 1 (0 for empty slots), see find_file_info
+    uint32_t file_info_slots_capacity; // always a power of 2
+    uint32_t *file_info_by_name; // file_info indexes sorted by name, see find_file_info_prefix
+    Byte **subfile_data; // views into bin_map
+    int bin_file; // file descriptor of the input .bin file, used to copy unchanged subfiles on the kernel side
+    Byte *bin_map; // read-only mapping of the whole input .bin file
+    size_t bin_map_size;
     struct _original_psb_data *raw_psb_data;
+    struct _psb_source source;
+    Byte *snapshot_map; // if the psb was loaded from a snapshot, most of the above points into this mapping
+    size_t snapshot_map_size;
+};
+
+// simple bump allocator; everything that belongs to a psb_data gets allocated from its arena and is freed all at once
+#define ARENA_BLOCK_SIZE (256 * 1024)
+
+struct _arena_block {
+    struct _arena_block *next;
+    size_t used;
+    size_t capacity;
+    max_align_t data[];
+};
+
+struct _arena {
+    struct _arena_block *blocks; // the first block is the one currently allocated from
 };
 
+typedef struct _arena_block arena_block;
+typedef struct _arena arena;
 typedef struct _file_info file_info;
-typedef struct _type_value type_value;
-typedef struct _name_object name_object;
+typedef struct _psb_nodes psb_nodes;
 typedef struct _psb_header psb_header;
 typedef struct _psb_data psb_data;
 typedef struct _original_psb_data original_psb_data;
+typedef struct _psb_source psb_source;
+typedef struct _psb_pack_state psb_pack_state;
 
+// points at a node of the entries of a psb
+struct _psb_cursor {
+    psb_data *psb;
+    uint32_t node; // NO_NODE if the cursor doesn't point anywhere, e.g. because cursor_find didn't find anything
+};
 
-void free_psb_data(psb_data *my_psb_data)
-{
-    free(my_psb_data->header);
-
-    for (int i = 0; i < my_psb_data->names_amount; i++) {
-        free(my_psb_data->names[i]);
-    }
-    free(my_psb_data->names);
+typedef struct _psb_cursor psb_cursor;
 
-    for (int i = 0; i < my_psb_data->strings_amount; i++) {
-        free(my_psb_data->strings[i]);
-    }
-    free(my_psb_data->strings);
 
-    for (int i = 0; i < my_psb_data->chunkdata_size; i++) {
-        free(my_psb_data->chunkdata[i]);
-    }
-    free(my_psb_data->chunkdata);
+arena *arena_create(void)
+{
+    arena *new_arena = malloc(sizeof(arena));
+    new_arena->blocks = NULL;
+    return new_arena;
+}
 
-    for (int i = 0; i < my_psb_data->entries->value_length; i++) {
-        if (my_psb_data->entries->value.name_object_array[i]) {
-            name_object *current_typevalue = my_psb_data->entries->value.name_object_array[i];
-            if (current_typevalue->object->type == 32) {
-                free(current_typevalue->object->value.type_value_object);
-            } else if (current_typevalue->object->type == 33) { // file_info object
-                for (int j = 0; j < my_psb_data->file_info_amount; j++) {
-                    free(current_typevalue->object->value.name_object_array[j]->object->value.type_value_array[0]); // relies on the knowledge that these arrays will contain exactly 2 elements
-                    free(current_typevalue->object->value.name_object_array[j]->object->value.type_value_array[1]);
-                    free(current_typevalue->object->value.name_object_array[j]->object->value.type_value_array);
-                    free(current_typevalue->object->value.name_object_array[j]->object);
-                    free(current_typevalue->object->value.name_object_array[j]);
-                }
-                free(current_typevalue->object->value.name_object_array);
-            }
-            free(current_typevalue->object);
-            free(current_typevalue);
+// Returns size bytes of uninitialized memory that stay valid until arena_destroy is called
+void *arena_alloc(arena *my_arena, size_t size)
+{
+    size = (size + sizeof(max_align_t) - 1) / sizeof(max_align_t) * sizeof(max_align_t); // keep everything aligned
+    arena_block *block = my_arena->blocks;
+    if (block == NULL || block->used + size > block->capacity) {
+        size_t capacity = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        arena_block *new_block = malloc(sizeof(arena_block) + capacity);
+        new_block->used = 0;
+        new_block->capacity = capacity;
+        if (block && size > ARENA_BLOCK_SIZE) { // big allocations get their own block, so the current one can still be used up
+            new_block->next = block->next;
+            block->next = new_block;
+        } else {
+            new_block->next = block;
+            my_arena->blocks = new_block;
         }
+        block = new_block;
     }
-    free(my_psb_data->entries->value.name_object_array);
-    free(my_psb_data->entries);
+    void *memory = (Byte *) block->data + block->used;
+    block->used += size;
+    return memory;
+}
 
-    for (int i = 0; i < my_psb_data->file_info_amount; i++) {
-        free(my_psb_data->file_info[i]);
-    }
-    free(my_psb_data->file_info);
+void *arena_calloc(arena *my_arena, size_t amount, size_t size)
+{
+    void *memory = arena_alloc(my_arena, amount * size);
+    memset(memory, 0, amount * size);
+    return memory;
+}
 
-    for (int i = 0; i < my_psb_data->file_info_amount; i++) {
-        free(my_psb_data->subfile_data[i]);
+void arena_destroy(arena *my_arena)
+{
+    while (my_arena->blocks) {
+        arena_block *next = my_arena->blocks->next;
+        free(my_arena->blocks);
+        my_arena->blocks = next;
     }
-    free(my_psb_data->subfile_data);
+    free(my_arena);
+}
 
-    free(my_psb_data->raw_psb_data->raw_names);
-    free(my_psb_data->raw_psb_data->raw_strings);
-    free(my_psb_data->raw_psb_data);
 
-    free(my_psb_data);
+// Adds amount nodes to the end of the table and returns the index of the first one. Only their raw data and parent need to be set.
+uint32_t add_psb_nodes(psb_nodes *nodes, uint32_t amount)
+{
+    if (nodes->amount + amount > nodes->capacity) {
+        while (nodes->amount + amount > nodes->capacity) {
+            nodes->capacity = nodes->capacity ? nodes->capacity * 2 : 1024;
+        }
+        nodes->types = realloc(nodes->types, nodes->capacity * sizeof(uint8_t));
+        nodes->values = realloc(nodes->values, nodes->capacity * sizeof(uint64_t));
+        nodes->lengths = realloc(nodes->lengths, nodes->capacity * sizeof(uint32_t));
+        nodes->first_children = realloc(nodes->first_children, nodes->capacity * sizeof(uint32_t));
+        nodes->name_indexes = realloc(nodes->name_indexes, nodes->capacity * sizeof(uint32_t));
+        nodes->parents = realloc(nodes->parents, nodes->capacity * sizeof(uint32_t));
+        nodes->raw_data = realloc(nodes->raw_data, nodes->capacity * sizeof(Byte *));
+        nodes->raw_sizes = realloc(nodes->raw_sizes, nodes->capacity * sizeof(uint32_t));
+    }
+    uint32_t first_node = nodes->amount;
+    nodes->amount += amount;
+    memset(&nodes->types[first_node], 0, amount * sizeof(uint8_t));
+    memset(&nodes->name_indexes[first_node], 0, amount * sizeof(uint32_t));
+    memset(&nodes->raw_sizes[first_node], 0, amount * sizeof(uint32_t));
+    return first_node;
 }
 
-// Modifies the provided data using an xor method that uses the basename of the provided filename
-void xor_data(Byte *data, const char *file_name, int data_length)
+void free_psb_nodes(psb_nodes *nodes)
 {
-    Byte xor_key[80];
-    int filename_length = strlen(file_name);
-    if (filename_length >= 13 && strcmp(&file_name[filename_length - 13], "alldata.psb.m") == 0) { // ez way out
-        memcpy(xor_key, "\x3e\xa2\xcb\x35\xb4\x83\x46\xe9\x9a\xaf\xd1\xcc\xb4\x5e\x51\xd5\xe4\xa2\x64\x96\xb8\x23\x63\x1b\xfc\x49\xb6\x34\x93\xef\x93\x1b\x2b\x8f\x74\xf1\x1e\x10\x24\x80\x11\x8f\xda\xaf\xaf\xe6\x69\xc0\x8b\x18\xd5\xbd\x89\x8a\x0b\xf0\xa8\x5b\x8a\x8e\x58\x21\x8b\x17\x60\x9c\xd2\xe3\xc7\x5a\x22\xdd\xde\x7b\x23\xf2\x74\x3e\x47\x59", 80);
-    } else {
-        // we need to calculate the xor_key based on the file_name
+    free(nodes->types);
+    free(nodes->values);
+    free(nodes->lengths);
+    free(nodes->first_children);
+    free(nodes->name_indexes);
+    free(nodes->parents);
+    free(nodes->raw_data);
+    free(nodes->raw_sizes);
+}
 
-        int basename_index;
-        for (basename_index = filename_length; basename_index > 0; basename_index--) { // figure out the basename
-            if (file_name[basename_index-1] == '/' || file_name[basename_index-1] == '\\') {
-                break;
-            }
-        }
-        int basename_length = filename_length - basename_index;
-        Byte hash_seed[basename_length + 13];
-        memcpy(hash_seed, "MX8wgGEJ2+M47", 13); // fixed seed part from m2engage.elf
-        for (int i = 0; i < basename_length; i++) { // lower the basename and save it in our hash_seed
-            hash_seed[13+i] = tolower(file_name[basename_index+i]);
-        }
 
-        if (debug) {
-            printf("Using hash seed: ");
-            for (int i = 0; i < basename_length + 13; i++) {
-                printf("%c", hash_seed[i]);
-            }
-            printf("\n");
-        }
+void free_psb_data(psb_data *my_psb_data)
+{
+    // only the mappings and the node table live outside of the arena
+    if (my_psb_data->bin_map) {
+        munmap(my_psb_data->bin_map, my_psb_data->bin_map_size);
+    }
+    if (my_psb_data->snapshot_map) {
+        munmap(my_psb_data->snapshot_map, my_psb_data->snapshot_map_size);
+    }
+    if (my_psb_data->bin_file != -1) {
+        close(my_psb_data->bin_file);
+    }
+    free_psb_nodes(&my_psb_data->entries);
 
-        Byte md5_hash[16];
-        MD5(hash_seed, basename_length + 13, md5_hash); // generate the 16-byte MD5 of our hash_seed
+    arena_destroy(my_psb_data->arena); // this includes my_psb_data itself
+}
 
-        if (debug) {
-            printf("md5 of hash seed: ");
-            for (int i = 0; i < 16; i++) {
-                printf(md5_hash[i] < 127 && md5_hash[i] > 31 ? "%c" : "\\x%02x", md5_hash[i]);
-            }
-            printf("\n");
-        }
+// an array of ints as it is stored in the psb, for reading it without copying it anywhere
+struct _int_array_view {
+    uint32_t count;
+    int entry_width;
+    const Byte *entries;
+};
 
-        init_by_array((uint32_t *) md5_hash, 4); // initialize the mersenne twister
-        for (int i = 0; i < 20; i++) {
-            ((uint32_t *) xor_key)[i] = genrand_int32();
-        }
+typedef struct _int_array_view int_array_view;
 
-        if (debug) {
-            printf("Using xor key: ");
-            for (int i = 0; i < 80; i++) {
-                printf("%x", xor_key[i]);
-            }
-            printf("\n");
-        }
+// Reads the array of ints (types 13 - 20) at pointer into view and returns the position right behind it
+const Byte *read_int_array(const Byte *pointer, int_array_view *view)
+{
+    uint8_t type = *pointer++;
+    if (type < 13 || type > 20) {
+        fprintf(stderr, "Error when extracting: Expected an array of ints, got type %d.\n", type);
+        exit(EXIT_FAILURE);
     }
+    int count_size = type - 12;
+    view->count = 0;
+    memcpy(&view->count, pointer, count_size);
+    pointer += count_size;
+    view->entry_width = *pointer++ - 12;
+    view->entries = pointer;
+    return pointer + view->count * view->entry_width;
+}
 
-    // xor the data with the generated xor_key
-    for (int i = 0; i < data_length; i++) {
-        data[i] ^= xor_key[i % 80];
-    }
+uint32_t get_int_array_entry(const int_array_view *view, uint32_t index)
+{
+    uint32_t value = 0;
+    memcpy(&value, &view->entries[index * view->entry_width], view->entry_width);
+    return value;
 }
 
+// Decoding kernels for whole arrays of ints, one for every entry width. They all decode count entries from in to out
+// and return the amount they handled; the SIMD ones leave the rest to the plain ones.
 
-int get_unsigned_byte_size(uint64_t value)
+static uint32_t decode_entries_1(const Byte *in, uint32_t *out, uint32_t count)
 {
-    if (!value) return 1;
-    return (71 - __builtin_clzll(value)) / 8;
+    for (uint32_t i = 0; i < count; i++) {
+        out[i] = in[i];
+    }
+    return count;
 }
 
-int get_signed_byte_size(uint64_t value)
+static uint32_t decode_entries_2(const Byte *in, uint32_t *out, uint32_t count)
 {
-    if (!value) return 1;
-    return (72 - __builtin_clzll(value)) / 8;
+    for (uint32_t i = 0; i < count; i++) {
+        out[i] = in[2*i] | in[2*i + 1] << 8;
+    }
+    return count;
 }
 
+static uint32_t decode_entries_3(const Byte *in, uint32_t *out, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++) {
+        out[i] = in[3*i] | in[3*i + 1] << 8 | (uint32_t) in[3*i + 2] << 16;
+    }
+    return count;
+}
 
-// packs data from the type_value object to_pack and returns it, setting current_size to the amount of bytes packed
-Byte *pack_data(psb_data *my_psb_data, type_value *to_pack, int *current_size)
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse4.1")))
+static uint32_t decode_entries_1_sse41(const Byte *in, uint32_t *out, uint32_t count)
 {
-    Byte *return_data;
-    assert(current_size);
-    uint8_t type = to_pack->type;
+    uint32_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i *) &in[i]);
+        _mm_storeu_si128((__m128i *) &out[i], _mm_cvtepu8_epi32(bytes));
+        _mm_storeu_si128((__m128i *) &out[i + 4], _mm_cvtepu8_epi32(_mm_srli_si128(bytes, 4)));
+        _mm_storeu_si128((__m128i *) &out[i + 8], _mm_cvtepu8_epi32(_mm_srli_si128(bytes, 8)));
+        _mm_storeu_si128((__m128i *) &out[i + 12], _mm_cvtepu8_epi32(_mm_srli_si128(bytes, 12)));
+    }
+    return i;
+}
 
-    if (debug) {
-        printf("Now starting to pack type_value object with type %d.\n", type);
+__attribute__((target("sse4.1")))
+static uint32_t decode_entries_2_sse41(const Byte *in, uint32_t *out, uint32_t count)
+{
+    uint32_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m128i words = _mm_loadu_si128((const __m128i *) &in[2*i]);
+        _mm_storeu_si128((__m128i *) &out[i], _mm_cvtepu16_epi32(words));
+        _mm_storeu_si128((__m128i *) &out[i + 4], _mm_cvtepu16_epi32(_mm_srli_si128(words, 8)));
     }
+    return i;
+}
 
-    if (type == 0 || type > 33) {
-        fprintf(stderr, "Error when packing: type_value has unknown type %d.\n", type);
-        fprintf(stderr, "Will abort now.\n");
-        exit(EXIT_FAILURE);
+__attribute__((target("sse4.1")))
+static uint32_t decode_entries_3_sse41(const Byte *in, uint32_t *out, uint32_t count)
+{
+    // every load reads 16 bytes but only uses 12 of them, so stop while there are still enough entries behind it
+    const __m128i spread = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    uint32_t i = 0;
+    for (; i + 6 <= count; i += 4) {
+        __m128i bytes = _mm_loadu_si128((const __m128i *) &in[3*i]);
+        _mm_storeu_si128((__m128i *) &out[i], _mm_shuffle_epi8(bytes, spread));
     }
+    return i;
+}
 
-    if (type <= 4) {
-        // length = 0, purpose unknown
+// this only reads what libgcc found out about the cpu at startup, so it's cheap enough to ask every time
+static _Bool has_sse41(void)
+{
+    return __builtin_cpu_supports("sse4.1");
+}
+#endif
+
+// Decodes all entries of the array into out, using the kernel for its entry width
+void decode_int_array(const int_array_view *view, uint32_t *out)
+{
+    const Byte *in = view->entries;
+    uint32_t count = view->count;
+    uint32_t done = 0;
+
+    switch (view->entry_width) {
+        case 1:
+#if defined(__x86_64__) || defined(__i386__)
+            if (has_sse41()) done = decode_entries_1_sse41(in, out, count);
+#endif
+            decode_entries_1(&in[done], &out[done], count - done);
+            break;
+        case 2:
+#if defined(__x86_64__) || defined(__i386__)
+            if (has_sse41()) done = decode_entries_2_sse41(in, out, count);
+#endif
+            decode_entries_2(&in[2*done], &out[done], count - done);
+            break;
+        case 3:
+#if defined(__x86_64__) || defined(__i386__)
+            if (has_sse41()) done = decode_entries_3_sse41(in, out, count);
+#endif
+            decode_entries_3(&in[3*done], &out[done], count - done);
+            break;
+        case 4:
+            memcpy(out, in, count * sizeof(uint32_t));
+            break;
+        default:
+            for (uint32_t i = 0; i < count; i++) {
+                out[i] = get_int_array_entry(view, i);
+            }
+    }
+}
 
-        return_data = malloc(1);
-        *current_size = 1;
-        return_data[0] = type;
 
-    } else if (type <= 12) {
-        // int, 1 - 8 bytes
-        // it works, I hope; even if it looks weird
+void read_psb_node(psb_data *my_psb_data, uint32_t node);
+void expand_psb_node(psb_data *my_psb_data, uint32_t node);
 
-        int size = get_signed_byte_size(to_pack->value.long_integer);
+psb_cursor cursor_root(psb_data *my_psb_data)
+{
+    psb_cursor root = {my_psb_data, 0};
+    return root;
+}
 
-        return_data = malloc(size + 1);
-        return_data[0] = size + 4;
-        memcpy(&return_data[1], &to_pack->value.long_integer, size);
+_Bool cursor_valid(psb_cursor cursor)
+{
+    return cursor.node != NO_NODE;
+}
 
-        *current_size = size + 1;
+// makes sure the node the cursor points at has been read
+static psb_nodes *cursor_nodes(psb_cursor cursor)
+{
+    if (cursor.psb->entries.types[cursor.node] == 0) {
+        read_psb_node(cursor.psb, cursor.node);
+    }
+    return &cursor.psb->entries;
+}
 
-    } else if (type <= 20) {
-        // array of ints, in the form "size of count, count, size of entries, entries[]"
+uint8_t cursor_type(psb_cursor cursor)
+{
+    return cursor_nodes(cursor)->types[cursor.node];
+}
 
-        int size_count = get_unsigned_byte_size((uint64_t) to_pack->value_length);
+// the value of an int (4 - 12) or the index of a string (21 - 24) or chunk (25 - 28)
+uint64_t cursor_integer(psb_cursor cursor)
+{
+    return cursor_nodes(cursor)->values[cursor.node];
+}
 
-        int largest_value = 0;
-        for (int i = 0; i < to_pack->value_length; i++) {
-            if (to_pack->value.integer_array[i] > largest_value) {
-                largest_value = to_pack->value.integer_array[i];
-            }
-        }
-        int size_entries = get_unsigned_byte_size((uint64_t) largest_value);
+float cursor_float(psb_cursor cursor)
+{
+    float value;
+    memcpy(&value, &cursor_nodes(cursor)->values[cursor.node], sizeof(float));
+    return value;
+}
 
-        return_data = malloc(1 + size_count + 1 + (size_entries * to_pack->value_length));
-        return_data[0] = size_count + 12;
-        memcpy(&return_data[1], &to_pack->value_length, size_count);
-        return_data[1 + size_count] = size_entries + 12;
+double cursor_double(psb_cursor cursor)
+{
+    double value;
+    memcpy(&value, &cursor_nodes(cursor)->values[cursor.node], sizeof(double));
+    return value;
+}
 
-        *current_size = 1 + 1 + size_count;
-        for (int i = 0; i < to_pack->value_length; i++) {
-            memcpy(&return_data[*current_size], &to_pack->value.integer_array[i], size_entries);
-            *current_size += size_entries;
-        }
+// the amount of entries of an array of ints, or of children of type 32/33
+uint32_t cursor_length(psb_cursor cursor)
+{
+    return cursor_nodes(cursor)->lengths[cursor.node];
+}
 
-    } else if (type <= 24) {
-        // index into strings array, 1-4 bytes
+// arrays of ints are read directly from the raw data, they are never copied
+uint32_t cursor_array_entry(psb_cursor cursor, uint32_t index)
+{
+    int_array_view array;
+    read_int_array(cursor_nodes(cursor)->raw_data[cursor.node], &array);
+    return get_int_array_entry(&array, index);
+}
 
-        int size = get_unsigned_byte_size((uint64_t) to_pack->value.integer);
+psb_cursor cursor_child(psb_cursor cursor, uint32_t index)
+{
+    expand_psb_node(cursor.psb, cursor.node);
+    psb_cursor child = {cursor.psb, cursor.psb->entries.first_children[cursor.node] + index};
+    return child;
+}
 
-        return_data = malloc(size + 1);
-        return_data[0] = size + 20;
-        Byte *byte_pointer = (Byte *) &to_pack->value.integer;
-        memcpy(&return_data[1], byte_pointer, size);
+// the name of the node inside its (type 33) parent, or NULL
+const char *cursor_name(psb_cursor cursor)
+{
+    uint32_t parent = cursor.psb->entries.parents[cursor.node];
+    if (parent == NO_NODE || cursor.psb->entries.types[parent] != 33) {
+        return NULL;
+    }
+    return cursor.psb->names[cursor.psb->entries.name_indexes[cursor.node]];
+}
 
-        *current_size = size + 1;
+// Returns the child of a type 33 object with the given name, or an invalid cursor if there is none.
+// Only the names are compared, none of the other children get read.
+psb_cursor cursor_find(psb_cursor cursor, const char *name)
+{
+    psb_cursor found = {cursor.psb, NO_NODE};
+    if (cursor_type(cursor) != 33) {
+        return found;
+    }
+    expand_psb_node(cursor.psb, cursor.node);
+    psb_nodes *nodes = &cursor.psb->entries;
+    for (uint32_t child = nodes->first_children[cursor.node]; child < nodes->first_children[cursor.node] + nodes->lengths[cursor.node]; child++) {
+        if (strcmp(cursor.psb->names[nodes->name_indexes[child]], name) == 0) {
+            found.node = child;
+            break;
+        }
+    }
+    return found;
+}
 
-    } else if (type <= 28) {
-        // index into chunks array, 1-4 bytes
+uint64_t get_file_info_offset(psb_data *my_psb_data, int index)
+{
+    return my_psb_data->entries.values[my_psb_data->file_info[index].offset_node];
+}
 
-        int size = get_unsigned_byte_size((uint64_t) to_pack->value.integer);
+uint64_t get_file_info_length(psb_data *my_psb_data, int index)
+{
+    return my_psb_data->entries.values[my_psb_data->file_info[index].length_node];
+}
 
-        return_data = malloc(size + 1);
-        return_data[0] = size + 20;
-        Byte *byte_pointer = (Byte *) &to_pack->value.integer;
-        memcpy(&return_data[1], byte_pointer, size);
+// One injection into a loaded psb, which is used as a template: the template never gets changed, so any amount of
+// injections can be made from it without loading it again. An injection only has its own file_info offsets and lengths
+// and the data of the subfiles it replaced, everything else is taken from the template when packing.
+struct _psb_injection {
+    psb_data *template;
+    uint64_t *offsets;
+    uint64_t *lengths;
+    int *replaced_files; // see create_payload_file, -1 for subfiles that are taken from the template
+    char *work_directory; // where the files for the replaced subfiles are created
+};
 
-        *current_size = size + 1;
+typedef struct _psb_injection psb_injection;
 
-    } else if (type == 29) {
-        // 0 byte float
+// out_file is the psb.m the injection is going to be written to
+psb_injection *create_injection(psb_data *template, const char *out_file)
+{
+    psb_injection *injection = malloc(sizeof(psb_injection));
+    injection->template = template;
+    injection->offsets = malloc(template->file_info_amount * sizeof(uint64_t));
+    injection->lengths = malloc(template->file_info_amount * sizeof(uint64_t));
+    injection->replaced_files = malloc(template->file_info_amount * sizeof(int));
+    for (int i = 0; i < template->file_info_amount; i++) {
+        injection->offsets[i] = get_file_info_offset(template, i);
+        injection->lengths[i] = get_file_info_length(template, i);
+        injection->replaced_files[i] = -1;
+    }
+    injection->work_directory = strdup(out_file);
+    char *separator = strrchr(injection->work_directory, '/');
+    if (separator == NULL) {
+        strcpy(injection->work_directory, ".");
+    } else if (separator == injection->work_directory) {
+        separator[1] = '\0';
+    } else {
+        separator[0] = '\0';
+    }
+    return injection;
+}
 
-        return_data = malloc(1);
-        *current_size = 1;
-        return_data[0] = type;
+void free_injection(psb_injection *injection)
+{
+    for (int i = 0; i < injection->template->file_info_amount; i++) {
+        if (injection->replaced_files[i] != -1) {
+            close(injection->replaced_files[i]);
+        }
+    }
+    free(injection->offsets);
+    free(injection->lengths);
+    free(injection->replaced_files);
+    free(injection->work_directory);
+    free(injection);
+}
 
-    } else if (type == 30) {
-        // 4 byte float
+// Creates an unlinked file in the work directory of the injection to hold the new data of a subfile, so that it doesn't have
+// to stay in memory until the bin is written; being next to the output, it can usually be reflinked or copied in the kernel.
+// Returns -1 if that isn't possible.
+int create_payload_file(psb_injection *injection)
+{
+    int file = -1;
+#ifdef O_TMPFILE
+    file = open(injection->work_directory, O_TMPFILE | O_RDWR, 0600);
+    if (file != -1) {
+        return file;
+    }
+#endif
+    char file_name[strlen(injection->work_directory) + 24];
+    sprintf(file_name, "%s/.psb_payload_XXXXXX", injection->work_directory);
+    file = mkstemp(file_name);
+    if (file != -1) {
+        unlink(file_name);
+    }
+    return file;
+}
 
-        return_data = malloc(5);
-        *current_size = 5;
-        return_data[0] = type;
-        memcpy(&return_data[1], &to_pack->value.float_value, 4);
+// Replaces the data of a subfile with a file from create_payload_file, which from then on is owned (and closed) by the injection
+void replace_subfile_data(psb_injection *injection, int index, int new_file)
+{
+    if (injection->replaced_files[index] != -1) {
+        close(injection->replaced_files[index]);
+    }
+    injection->replaced_files[index] = new_file;
+}
 
-    } else if (type == 31) {
-        // 8 byte double
+int get_thread_count(void);
+void run_parallel(void (*function)(void *context, int index), void *context, int count);
 
-        return_data = malloc(9);
-        *current_size = 9;
-        return_data[0] = type;
-        memcpy(&return_data[1], &to_pack->value.double_value, 8);
+// Keys that were already generated, by lowercased basename. Generating one takes an MD5 and seeding a mersenne twister,
+// which adds up when a lot of subfiles get encrypted or decrypted; get_xor_key looks here first.
+struct _xor_key_cache_entry {
+    char *basename; // NULL for empty slots
+    Byte xor_key[80];
+};
 
-    } else if (type == 32) {
-        // array of type_values
-        // array of offsets of objects, followed by the objects
+struct _xor_key_cache {
+    pthread_mutex_t lock;
+    uint32_t amount;
+    uint32_t capacity; // always a power of 2
+    struct _xor_key_cache_entry *entries;
+};
 
-        return_data = malloc(1);
-        memcpy(return_data, &type, 1);
-        *current_size = 1;
+struct _xor_key_cache xor_key_cache = {PTHREAD_MUTEX_INITIALIZER, 0, 0, NULL};
 
-        int next_offset = 0;
-        uint32_t *temp_offsets = malloc(to_pack->value_length * sizeof(uint32_t));
-        Byte *temp_data = malloc(0);
+static uint32_t hash_string(const char *string, int length)
+{
+    uint32_t hash = 2166136261u; // FNV-1a
+    for (int i = 0; i < length; i++) {
+        hash = (hash ^ (Byte) string[i]) * 16777619u;
+    }
+    return hash;
+}
 
-        for (int i = 0; i < to_pack->value_length; i++) {
-            int returned_size;
-            Byte *returned_data = pack_data(my_psb_data, to_pack->value.type_value_array[i], &returned_size);
+// returns the slot of basename in the cache, or the empty slot it would go in; the cache lock has to be held
+static struct _xor_key_cache_entry *find_xor_key_slot(const char *basename, int length)
+{
+    uint32_t slot = hash_string(basename, length) & (xor_key_cache.capacity - 1);
+    while (xor_key_cache.entries[slot].basename && !(strncmp(xor_key_cache.entries[slot].basename, basename, length) == 0 && xor_key_cache.entries[slot].basename[length] == '\0')) {
+        slot = (slot + 1) & (xor_key_cache.capacity - 1);
+    }
+    return &xor_key_cache.entries[slot];
+}
 
-            if (debug) {
-                for (int i = 0; i < returned_size; i++) {
-                    printf("%02x ", returned_data[i]);
-                }
-                printf("\n");
+static void add_cached_xor_key(const char *basename, int length, const Byte *xor_key)
+{
+    pthread_mutex_lock(&xor_key_cache.lock);
+    if (2 * (xor_key_cache.amount + 1) > xor_key_cache.capacity) { // keep it at most half full
+        struct _xor_key_cache_entry *old_entries = xor_key_cache.entries;
+        uint32_t old_capacity = xor_key_cache.capacity;
+        xor_key_cache.capacity = old_capacity ? old_capacity * 2 : 64;
+        xor_key_cache.entries = calloc(xor_key_cache.capacity, sizeof(struct _xor_key_cache_entry));
+        for (uint32_t i = 0; i < old_capacity; i++) {
+            if (old_entries[i].basename) {
+                *find_xor_key_slot(old_entries[i].basename, strlen(old_entries[i].basename)) = old_entries[i];
             }
+        }
+        free(old_entries);
+    }
 
-            temp_offsets[i] = next_offset;
+    struct _xor_key_cache_entry *entry = find_xor_key_slot(basename, length);
+    if (!entry->basename) { // another thread might have added it in the meantime
+        entry->basename = malloc(length + 1);
+        memcpy(entry->basename, basename, length);
+        entry->basename[length] = '\0';
+        memcpy(entry->xor_key, xor_key, 80);
+        xor_key_cache.amount++;
+    }
+    pthread_mutex_unlock(&xor_key_cache.lock);
+}
 
-            temp_data = realloc(temp_data, next_offset + returned_size);
-            memcpy(&temp_data[next_offset], returned_data, returned_size);
-            free(returned_data);
-            next_offset += returned_size;
+static _Bool get_cached_xor_key(const char *basename, int length, Byte *xor_key)
+{
+    _Bool found = 0;
+    pthread_mutex_lock(&xor_key_cache.lock);
+    if (xor_key_cache.capacity) {
+        struct _xor_key_cache_entry *entry = find_xor_key_slot(basename, length);
+        if (entry->basename) {
+            memcpy(xor_key, entry->xor_key, 80);
+            found = 1;
         }
+    }
+    pthread_mutex_unlock(&xor_key_cache.lock);
+    return found;
+}
 
-        type_value *temp_offsets_typevalue = malloc(sizeof(type_value));
-        temp_offsets_typevalue->type = 13;
-        temp_offsets_typevalue->value_length = to_pack->value_length;
-        temp_offsets_typevalue->value.integer_array = temp_offsets;
-
-        int returned_count;
-        Byte *wtf_offsets_temp = pack_data(my_psb_data, temp_offsets_typevalue, &returned_count);
-        free(temp_offsets);
-        free(temp_offsets_typevalue);
-        return_data = realloc(return_data, *current_size + returned_count);
-        memcpy(&return_data[*current_size], wtf_offsets_temp, returned_count);
-        free(wtf_offsets_temp);
-        *current_size += returned_count;
+void free_xor_key_cache(void)
+{
+    for (uint32_t i = 0; i < xor_key_cache.capacity; i++) {
+        free(xor_key_cache.entries[i].basename);
+    }
+    free(xor_key_cache.entries);
+    xor_key_cache.entries = NULL;
+    xor_key_cache.amount = 0;
+    xor_key_cache.capacity = 0;
+}
 
-        return_data = realloc(return_data, *current_size + next_offset);
-        memcpy(&return_data[*current_size], temp_data, next_offset);
-        free(temp_data);
-        *current_size += next_offset;
-        if (debug) {
-            for (int i = 0; i < *current_size; i++) {
-                printf("%02x ", return_data[i]);
-            }
-            printf("\n");
+// Writes the lowercased basename of file_name to lowered (which needs strlen(file_name) bytes) and returns its length
+static int get_lowered_basename(const char *file_name, char *lowered)
+{
+    int filename_length = strlen(file_name);
+    int basename_index;
+    for (basename_index = filename_length; basename_index > 0; basename_index--) { // figure out the basename
+        if (file_name[basename_index-1] == '/' || file_name[basename_index-1] == '\\') {
+            break;
         }
+    }
+    int basename_length = filename_length - basename_index;
+    for (int i = 0; i < basename_length; i++) {
+        lowered[i] = tolower(file_name[basename_index+i]);
+    }
+    return basename_length;
+}
 
-    } else if (type == 33) {
-        // array of name_objects
-        // array of int name indexes, array of int offsets, followed by objects
+// Adds a key that was generated before (e.g. stored in a snapshot) to the cache, so get_xor_key doesn't have to generate it again
+void add_xor_key(const char *file_name, const Byte *xor_key)
+{
+    char lowered_basename[strlen(file_name) + 1];
+    add_cached_xor_key(lowered_basename, get_lowered_basename(file_name, lowered_basename), xor_key);
+}
 
-        return_data = malloc(1);
-        memcpy(return_data, &type, 1);
-        *current_size = 1;
+// Generates the 80 byte xor key that belongs to the basename of the provided filename
+void get_xor_key(const char *file_name, Byte *xor_key)
+{
+    Byte hash_seed[strlen(file_name) + 13];
+    memcpy(hash_seed, "MX8wgGEJ2+M47", 13); // fixed seed part from m2engage.elf
+    const char *lowered_basename = (const char *) &hash_seed[13]; // the lowered basename goes right behind it
+    int basename_length = get_lowered_basename(file_name, (char *) &hash_seed[13]);
 
-        int next_offset = 0;
-        uint32_t *temp_names = malloc(to_pack->value_length * sizeof(uint32_t));
-        uint32_t *temp_offsets = malloc(to_pack->value_length * sizeof(uint32_t));
-        Byte *temp_data = malloc(0);
+    if (get_cached_xor_key(lowered_basename, basename_length, xor_key)) {
+        return;
+    }
 
-        for (int i = 0; i < to_pack->value_length; i++) {
-            if (debug) {
-                printf("next offset: %d\n", next_offset);
-            }
-            int returned_size;
-            Byte *returned_data = pack_data(my_psb_data, to_pack->value.name_object_array[i]->object, &returned_size);
+    if (debug) {
+        printf("Using hash seed: ");
+        for (int i = 0; i < basename_length + 13; i++) {
+            printf("%c", hash_seed[i]);
+        }
+        printf("\n");
+    }
 
-            temp_names[i] = to_pack->value.name_object_array[i]->name_index;
-            temp_offsets[i] = next_offset;
+    Byte md5_hash[16];
+    MD5(hash_seed, basename_length + 13, md5_hash); // generate the 16-byte MD5 of our hash_seed
 
-            temp_data = realloc(temp_data, next_offset + returned_size);
-            memcpy(&temp_data[next_offset], returned_data, returned_size);
-            free(returned_data);
-            next_offset += returned_size;
+    if (debug) {
+        printf("md5 of hash seed: ");
+        for (int i = 0; i < 16; i++) {
+            printf(md5_hash[i] < 127 && md5_hash[i] > 31 ? "%c" : "\\x%02x", md5_hash[i]);
         }
+        printf("\n");
+    }
 
-        type_value *temp_names_typevalue = malloc(sizeof(type_value));
-        temp_names_typevalue->type = 13;
-        temp_names_typevalue->value_length = to_pack->value_length;
-        temp_names_typevalue->value.integer_array = temp_names;
+    mt_state mersenne_twister;
+    mt_init_by_array(&mersenne_twister, (uint32_t *) md5_hash, 4); // initialize the mersenne twister
+    for (int i = 0; i < 20; i++) {
+        ((uint32_t *) xor_key)[i] = mt_genrand_int32(&mersenne_twister);
+    }
 
-        int returned_count;
-        Byte *wtf_names_temp = pack_data(my_psb_data, temp_names_typevalue, &returned_count);
-        free(temp_names);
-        free(temp_names_typevalue);
-        return_data = realloc(return_data, *current_size + returned_count);
-        memcpy(&return_data[*current_size], wtf_names_temp, returned_count);
-        free(wtf_names_temp);
-        *current_size += returned_count;
+    if (debug) {
+        printf("Using xor key: ");
+        for (int i = 0; i < 80; i++) {
+            printf("%x", xor_key[i]);
+        }
+        printf("\n");
+    }
 
+    add_cached_xor_key(lowered_basename, basename_length, xor_key);
+}
 
-        type_value *temp_offsets_typevalue = malloc(sizeof(type_value));
-        temp_offsets_typevalue->type = 13;
-        temp_offsets_typevalue->value_length = to_pack->value_length;
-        temp_offsets_typevalue->value.integer_array = temp_offsets;
+static void precompute_xor_key_worker(void *context, int index)
+{
+    psb_data *my_psb_data = context;
+    Byte xor_key[80];
+    get_xor_key(my_psb_data->names[my_psb_data->file_info[index].name_index], xor_key);
+}
 
-        Byte *wtf_offsets_temp = pack_data(my_psb_data, temp_offsets_typevalue, &returned_count);
-        free(temp_offsets);
-        free(temp_offsets_typevalue);
-        return_data = realloc(return_data, *current_size + returned_count);
-        memcpy(&return_data[*current_size], wtf_offsets_temp, returned_count);
-        free(wtf_offsets_temp);
-        *current_size += returned_count;
+// Generates the keys of all subfiles in file_info up front, on all threads
+void precompute_xor_keys(psb_data *my_psb_data)
+{
+    run_parallel(precompute_xor_key_worker, my_psb_data, my_psb_data->file_info_amount);
+}
 
-        return_data = realloc(return_data, *current_size + next_offset);
-        memcpy(&return_data[*current_size], temp_data, next_offset);
-        free(temp_data);
-        *current_size += next_offset;
+static void xor_data_scalar(Byte *data, const Byte *xor_key, uLong data_length, uLong key_position)
+{
+    key_position %= 80;
+    for (uLong i = 0; i < data_length; i++) {
+        data[i] ^= xor_key[(key_position + i) % 80];
     }
-
-    return return_data;
 }
 
+#if defined(__x86_64__) || defined(__i386__)
+// The vector kernels xor the head byte by byte up to the first aligned address, then lay out the key from there on
+// for lcm(80, vector size) bytes: after that many bytes the same key vectors come around again.
+// Whatever is left at the end (less than that) is done with as many whole vectors as fit and then byte by byte.
 
-// Returns a malloc'd type_value object, based on the given pointer.
-// my_psb_data and return_count are used internally idk what the fuck to put here
-type_value *extract_data(psb_data *my_psb_data, Byte **pointer, uint32_t *return_count)
+__attribute__((target("avx2")))
+static void xor_data_avx2(Byte *data, const Byte *xor_key, uLong data_length, uLong key_position)
 {
-    uint8_t type;
-    memcpy(&type, *pointer, 1);
-    (*pointer)++;
+    uLong head = (32 - (uintptr_t) data % 32) % 32;
+    if (head > data_length) {
+        head = data_length;
+    }
+    xor_data_scalar(data, xor_key, head, key_position);
+    data += head;
+    data_length -= head;
+    key_position += head;
+
+    Byte pattern[160]; // lcm(80, 32)
+    for (int i = 0; i < 160; i++) {
+        pattern[i] = xor_key[(key_position + i) % 80];
+    }
+    __m256i keys[5];
+    for (int j = 0; j < 5; j++) {
+        keys[j] = _mm256_loadu_si256((const __m256i *) &pattern[32*j]);
+    }
 
-    if (debug) {
-        printf("Current offset value: %d\n", type);
+    uLong i = 0;
+    for (; i + 160 <= data_length; i += 160) {
+        for (int j = 0; j < 5; j++) {
+            __m256i *vector = (__m256i *) &data[i + 32*j];
+            _mm256_store_si256(vector, _mm256_xor_si256(_mm256_load_si256(vector), keys[j]));
+        }
     }
+    for (int j = 0; i + 32 <= data_length; i += 32, j++) {
+        __m256i *vector = (__m256i *) &data[i];
+        _mm256_store_si256(vector, _mm256_xor_si256(_mm256_load_si256(vector), keys[j]));
+    }
+    xor_data_scalar(&data[i], xor_key, data_length - i, key_position + i);
+}
 
-    if (type == 0 || type > 33) {
-        fprintf(stderr, "Error when extracting: Unknown type %d.\n", type);
-        fprintf(stderr, "will exit now just in case.");
-        exit(EXIT_FAILURE);
+__attribute__((target("sse2")))
+static void xor_data_sse2(Byte *data, const Byte *xor_key, uLong data_length, uLong key_position)
+{
+    uLong head = (16 - (uintptr_t) data % 16) % 16;
+    if (head > data_length) {
+        head = data_length;
+    }
+    xor_data_scalar(data, xor_key, head, key_position);
+    data += head;
+    data_length -= head;
+    key_position += head;
+
+    Byte pattern[80]; // lcm(80, 16)
+    for (int i = 0; i < 80; i++) {
+        pattern[i] = xor_key[(key_position + i) % 80];
+    }
+    __m128i keys[5];
+    for (int j = 0; j < 5; j++) {
+        keys[j] = _mm_loadu_si128((const __m128i *) &pattern[16*j]);
     }
 
-    type_value *return_type_value = malloc(sizeof(type_value));
-    return_type_value->type = type;
+    uLong i = 0;
+    for (; i + 80 <= data_length; i += 80) {
+        for (int j = 0; j < 5; j++) {
+            __m128i *vector = (__m128i *) &data[i + 16*j];
+            _mm_store_si128(vector, _mm_xor_si128(_mm_load_si128(vector), keys[j]));
+        }
+    }
+    for (int j = 0; i + 16 <= data_length; i += 16, j++) {
+        __m128i *vector = (__m128i *) &data[i];
+        _mm_store_si128(vector, _mm_xor_si128(_mm_load_si128(vector), keys[j]));
+    }
+    xor_data_scalar(&data[i], xor_key, data_length - i, key_position + i);
+}
+#endif
 
-    if (type <= 4) {
-        // length = 0, purpose unknown
+// Xors the data with xor_key, key_position is the position of data[0] in the whole xor'd stream
+void xor_data_with_key(Byte *data, const Byte *xor_key, uLong data_length, uLong key_position)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("avx2")) {
+        xor_data_avx2(data, xor_key, data_length, key_position);
+        return;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        xor_data_sse2(data, xor_key, data_length, key_position);
+        return;
+    }
+#endif
+    xor_data_scalar(data, xor_key, data_length, key_position);
+}
 
-        return_type_value->value.long_integer = 0L;
+// Modifies the provided data using an xor method that uses the basename of the provided filename
+void xor_data(Byte *data, const char *file_name, int data_length)
+{
+    Byte xor_key[80];
+    get_xor_key(file_name, xor_key);
 
-    } else if (type <= 12) {
-        // long, 1-8 bytes
+    // xor the data with the generated xor_key
+    xor_data_with_key(data, xor_key, data_length, 0);
+}
 
-        return_type_value->value.long_integer = 0L;
-        memcpy(&return_type_value->value.long_integer, *pointer, type - 4);
 
-    } else if (type <= 20) {
-        // array of ints, in the form "size of count, count, size of entries, entries[]"
+// Reads an mdf file ("mdf\0", uncompressed size, xor'd zlib stream) piece by piece: every chunk that is read from the file
+// gets decrypted and handed to inflate right away, so the compressed data never has to be in memory all at once.
+// The mdf data can sit anywhere inside of a file, which is how subfiles of the bin are stored.
+#define MDF_CHUNK_SIZE (256 * 1024)
 
-        int count_size = type - 12;
-        uint32_t count = 0;
-        memcpy(&count, *pointer, count_size);
-        *pointer += count_size;
+struct _mdf_reader {
+    int file;
+    uint64_t position; // where the next chunk gets read from
+    uint64_t remaining; // compressed bytes not read yet
+    uLong key_position;
+    Byte xor_key[80];
+    uint32_t uncompressed_size; // from the mdf header
+    _Bool finished;
+    _Bool failed; // the data couldn't be read or is broken, mdf_read doesn't read anything anymore then
+    z_stream stream;
+    Byte chunk[MDF_CHUNK_SIZE];
+};
 
-        int size_entries = 0;
-        memcpy(&size_entries, *pointer, 1);
-        size_entries -= 12;
-        (*pointer)++;
-        if (debug) {
-            printf("count: %d, size entries: %d\n", count, size_entries);
-        }
+typedef struct _mdf_reader mdf_reader;
 
-        return_type_value->value_length = count;
-        return_type_value->value.integer_array = calloc(count, sizeof(uint32_t));
-        for (int i = 0; i < count; i++) {
-            memcpy(&return_type_value->value.integer_array[i], *pointer, size_entries);
-            *pointer += size_entries;
-        }
+// Starts reading the mdf data of the given length at offset in file; name is used for the xor key.
+// Returns 0 if it isn't mdf data at all (or zlib can't be set up).
+_Bool mdf_open(mdf_reader *reader, int file, uint64_t offset, uint64_t length, const char *name)
+{
+    Byte header[8];
+    if (length < 8 || pread(file, header, 8, offset) != 8 || memcmp(header, "mdf\x00", 4) != 0) {
+        return 0;
+    }
 
-        if (debug) {
-            printf("Debug array output:\n");
-            if (count) { // make sure we actually have at least one element
-                printf("%d", return_type_value->value.integer_array[0]);
+    reader->file = file;
+    reader->position = offset + 8;
+    reader->remaining = length - 8;
+    reader->key_position = 0;
+    get_xor_key(name, reader->xor_key);
+    memcpy(&reader->uncompressed_size, &header[4], 4);
+    reader->finished = 0;
+    reader->failed = 0;
+
+    memset(&reader->stream, 0, sizeof(z_stream));
+    if (inflateInit(&reader->stream) != Z_OK) {
+        fprintf(stderr, "Error: couldn't initialize zlib.\n");
+        return 0;
+    }
+    return 1;
+}
+
+// Reads up to length uncompressed bytes into out and returns how many were read, which is only less at the end
+// or if the data is broken (reader->failed is set then)
+uLong mdf_read(mdf_reader *reader, Byte *out, uLong length)
+{
+    reader->stream.next_out = out;
+    reader->stream.avail_out = length;
+
+    while (reader->stream.avail_out && !reader->finished && !reader->failed) {
+        if (reader->stream.avail_in == 0 && reader->remaining) {
+            ssize_t chunk_size = pread(reader->file, reader->chunk, reader->remaining < MDF_CHUNK_SIZE ? reader->remaining : MDF_CHUNK_SIZE, reader->position);
+            if (chunk_size <= 0) {
+                fprintf(stderr, "Error: couldn't read the compressed data.\n");
+                reader->failed = 1;
+                break;
+            }
+            xor_data_with_key(reader->chunk, reader->xor_key, chunk_size, reader->key_position);
+            reader->key_position += chunk_size;
+            reader->position += chunk_size;
+            reader->remaining -= chunk_size;
+            reader->stream.next_in = reader->chunk;
+            reader->stream.avail_in = chunk_size;
+        }
+
+        int return_value = inflate(&reader->stream, Z_NO_FLUSH);
+        if (return_value == Z_STREAM_END) {
+            reader->finished = 1;
+        } else if (return_value != Z_OK && !(return_value == Z_BUF_ERROR && reader->remaining)) {
+            fprintf(stderr, "MAJOR error was occuring here; the uncompression failed.\n");
+            fprintf(stderr, "return_value: %d\n", return_value);
+            reader->failed = 1;
+        }
+    }
+
+    return length - reader->stream.avail_out;
+}
+
+void mdf_close(mdf_reader *reader)
+{
+    inflateEnd(&reader->stream);
+}
+
+// Starts reading the subfile at index out of the bin file, see mdf_open
+_Bool mdf_open_subfile(mdf_reader *reader, psb_data *my_psb_data, int index)
+{
+    return mdf_open(reader, my_psb_data->bin_file, get_file_info_offset(my_psb_data, index), get_file_info_length(my_psb_data, index),
+                    my_psb_data->names[my_psb_data->file_info[index].name_index]);
+}
+
+
+int get_unsigned_byte_size(uint64_t value)
+{
+    if (!value) return 1;
+    return (71 - __builtin_clzll(value)) / 8;
+}
+
+int get_signed_byte_size(uint64_t value)
+{
+    if (!value) return 1;
+    return (72 - __builtin_clzll(value)) / 8;
+}
+
+
+// the packed size of an array of ints, in the form "size of count, count, size of entries, entries[]"
+uint32_t get_packed_int_array_size(uint32_t count, int entry_width)
+{
+    return 1 + get_unsigned_byte_size(count) + 1 + entry_width * count;
+}
+
+// the entry width needed for all of values; or-ing them together gives the same width as their maximum, and that vectorizes
+int get_int_array_width(const uint32_t *values, uint32_t count)
+{
+    uint32_t all_bits = 0;
+    uint32_t i = 0;
+#ifdef __SSE2__
+    __m128i bits = _mm_setzero_si128();
+    for (; i + 4 <= count; i += 4) {
+        bits = _mm_or_si128(bits, _mm_loadu_si128((const __m128i *) &values[i]));
+    }
+    bits = _mm_or_si128(bits, _mm_srli_si128(bits, 8));
+    bits = _mm_or_si128(bits, _mm_srli_si128(bits, 4));
+    all_bits = _mm_cvtsi128_si32(bits);
+#endif
+    for (; i < count; i++) {
+        all_bits |= values[i];
+    }
+    return get_unsigned_byte_size(all_bits);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// keeps the low entry_width bytes of 4 ints at a time; the store writes 16 bytes, so it stops while there are still enough entries behind it
+__attribute__((target("ssse3")))
+static uint32_t encode_entries_ssse3(Byte *out, const uint32_t *values, uint32_t count, int entry_width)
+{
+    const __m128i narrow = entry_width == 1 ? _mm_setr_epi8(0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)
+                         : entry_width == 2 ? _mm_setr_epi8(0, 1, 4, 5, 8, 9, 12, 13, -1, -1, -1, -1, -1, -1, -1, -1)
+                         : _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    uint32_t i = 0;
+    for (; i * entry_width + 16 <= count * entry_width; i += 4) {
+        __m128i ints = _mm_loadu_si128((const __m128i *) &values[i]);
+        _mm_storeu_si128((__m128i *) &out[i * entry_width], _mm_shuffle_epi8(ints, narrow));
+    }
+    return i;
+}
+#endif
+
+// Writes the entries of an array of ints with the given width (see get_int_array_width) and returns the position behind them
+Byte *encode_int_array(Byte *out, const uint32_t *values, uint32_t count, int entry_width)
+{
+    uint32_t i = 0;
+    if (entry_width == 4) {
+        memcpy(out, values, count * sizeof(uint32_t));
+        return out + count * 4;
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("ssse3")) {
+        i = encode_entries_ssse3(out, values, count, entry_width);
+    }
+#endif
+    switch (entry_width) {
+        case 1:
+            for (; i < count; i++) {
+                out[i] = values[i];
             }
-            for (int i = 1; i < count; i++) {
-                printf(", %d", return_type_value->value.integer_array[i]);
+            break;
+        case 2:
+            for (; i < count; i++) {
+                out[2*i] = values[i];
+                out[2*i + 1] = values[i] >> 8;
+            }
+            break;
+        case 3:
+            for (; i < count; i++) {
+                out[3*i] = values[i];
+                out[3*i + 1] = values[i] >> 8;
+                out[3*i + 2] = values[i] >> 16;
             }
-            printf("\n");
+            break;
+    }
+    return out + count * entry_width;
+}
+
+// writes the "size of count, count, size of entries" part of an array of ints and returns the position of the first entry
+Byte *pack_int_array_header(Byte *out, uint32_t count, int entry_width)
+{
+    int count_width = get_unsigned_byte_size(count);
+    *out++ = count_width + 12;
+    memcpy(out, &count, count_width);
+    out += count_width;
+    *out++ = entry_width + 12;
+    return out;
+}
+
+
+// the children of large type 32/33 nodes are walked on all threads, in tasks of PARALLEL_WALK_TASK_SIZE children each
+#define PARALLEL_WALK_THRESHOLD 1024
+#define PARALLEL_WALK_TASK_SIZE 256
+
+struct _raw_walk {
+    const Byte *children; // the offsets are relative to this
+    int_array_view offsets;
+    const Byte **task_ends; // the end of the last child inside, for every task
+};
+
+static const Byte *walk_raw_node(const Byte *pointer, _Bool parallel);
+
+static void raw_walk_worker(void *context, int index)
+{
+    struct _raw_walk *walk = context;
+    uint32_t first_child = index * PARALLEL_WALK_TASK_SIZE;
+    uint32_t last_child = first_child + PARALLEL_WALK_TASK_SIZE;
+    if (last_child > walk->offsets.count) {
+        last_child = walk->offsets.count;
+    }
+
+    const Byte *end = walk->children;
+    for (uint32_t i = first_child; i < last_child; i++) {
+        const Byte *child_end = walk_raw_node(walk->children + get_int_array_entry(&walk->offsets, i), 0);
+        if (child_end > end) {
+            end = child_end;
         }
+    }
+    walk->task_ends[index] = end;
+}
 
+static const Byte *walk_raw_node(const Byte *pointer, _Bool parallel)
+{
+    uint8_t type = *pointer;
+
+    if (type == 0 || type > 33) {
+        fprintf(stderr, "Error when extracting: Unknown type %d.\n", type);
+        fprintf(stderr, "will exit now just in case.");
+        exit(EXIT_FAILURE);
+    } else if (type <= 4) {
+        return pointer + 1;
+    } else if (type <= 12) {
+        return pointer + 1 + type - 4;
+    } else if (type <= 20) {
+        int_array_view array;
+        return read_int_array(pointer, &array);
     } else if (type <= 24) {
-        // index into strings array, 1-4 bytes
+        return pointer + 1 + type - 20;
+    } else if (type <= 28) {
+        return pointer + 1 + type - 24;
+    } else if (type == 29) {
+        return pointer + 1;
+    } else if (type == 30) {
+        return pointer + 5;
+    } else if (type == 31) {
+        return pointer + 9;
+    }
+
+    // type 32/33: the raw data spans everything up to the end of the last child inside
+    int_array_view names;
+    int_array_view offsets;
+    pointer++;
+    if (type == 33) {
+        pointer = read_int_array(pointer, &names);
+    }
+    pointer = read_int_array(pointer, &offsets);
+    const Byte *end = pointer;
+
+    if (parallel && offsets.count >= PARALLEL_WALK_THRESHOLD) {
+        // the children are walked serially inside of the tasks, so the threads don't multiply; taking the largest end keeps the result the same
+        int task_amount = (offsets.count + PARALLEL_WALK_TASK_SIZE - 1) / PARALLEL_WALK_TASK_SIZE;
+        struct _raw_walk walk = {pointer, offsets, malloc(task_amount * sizeof(Byte *))};
+        run_parallel(raw_walk_worker, &walk, task_amount);
+        for (int i = 0; i < task_amount; i++) {
+            if (walk.task_ends[i] > end) {
+                end = walk.task_ends[i];
+            }
+        }
+        free(walk.task_ends);
+        return end;
+    }
+
+    for (uint32_t i = 0; i < offsets.count; i++) {
+        const Byte *child_end = walk_raw_node(pointer + get_int_array_entry(&offsets, i), parallel);
+        if (child_end > end) {
+            end = child_end;
+        }
+    }
+    return end;
+}
+
+// Returns the end of the raw data of the node at pointer, including everything inside of it.
+// This walks the raw data only, nothing gets added to the node table.
+const Byte *get_raw_node_end(const Byte *pointer)
+{
+    return walk_raw_node(pointer, get_thread_count() > 1);
+}
+
+// the size of the raw data of a node, which is only worked out once it's needed.
+// injections of the same template might get packed at the same time, so the size is stored atomically; it's the same either way.
+uint32_t get_node_raw_size(psb_nodes *nodes, uint32_t node)
+{
+    uint32_t raw_size = __atomic_load_n(&nodes->raw_sizes[node], __ATOMIC_RELAXED);
+    if (raw_size == 0) {
+        raw_size = get_raw_node_end(nodes->raw_data[node]) - nodes->raw_data[node];
+        __atomic_store_n(&nodes->raw_sizes[node], raw_size, __ATOMIC_RELAXED);
+    }
+    return raw_size;
+}
+
+// Marks the node and everything above it as modified, so they get packed anew instead of using their raw bytes
+void mark_dirty(psb_nodes *nodes, psb_pack_state *state, uint32_t node)
+{
+    while (node != NO_NODE && !state->dirty[node]) {
+        state->dirty[node] = 1;
+        node = nodes->parents[node];
+    }
+}
+
+// Sets up the serializer for an injection: the changed file_info values are the only modified nodes
+void init_pack_state(psb_injection *injection, psb_pack_state *state)
+{
+    psb_data *template = injection->template;
+    psb_nodes *nodes = &template->entries;
+    state->dirty = calloc(nodes->amount, sizeof(uint8_t));
+    state->values = calloc(nodes->amount, sizeof(uint64_t));
+    state->packed_sizes = malloc(nodes->amount * sizeof(uint32_t));
+    state->packed_widths = malloc(nodes->amount * sizeof(uint8_t));
+    state->packed_name_widths = malloc(nodes->amount * sizeof(uint8_t));
+
+    for (int i = 0; i < template->file_info_amount; i++) {
+        if (injection->offsets[i] != get_file_info_offset(template, i)) {
+            state->values[template->file_info[i].offset_node] = injection->offsets[i];
+            mark_dirty(nodes, state, template->file_info[i].offset_node);
+        }
+        if (injection->lengths[i] != get_file_info_length(template, i)) {
+            state->values[template->file_info[i].length_node] = injection->lengths[i];
+            mark_dirty(nodes, state, template->file_info[i].length_node);
+        }
+    }
+}
+
+void free_pack_state(psb_pack_state *state)
+{
+    free(state->dirty);
+    free(state->values);
+    free(state->packed_sizes);
+    free(state->packed_widths);
+    free(state->packed_name_widths);
+}
+
+// Sizing pass of the serializer: calculates the packed size and byte widths of all nodes that have to be packed anew,
+// which are the root and the children of modified nodes; unmodified nodes are packed by copying their raw bytes.
+// This is a reverse scan over the node table, children come after their parents so their sizes are always known already.
+// Returns the packed size of the whole entries.
+uint32_t get_packed_entries_size(psb_nodes *nodes, psb_pack_state *state)
+{
+    for (uint32_t i = nodes->amount; i-- > 0;) {
+        if (i != 0 && !state->dirty[nodes->parents[i]]) {
+            continue;
+        }
+        uint8_t type = nodes->types[i];
+        uint64_t value = state->dirty[i] ? state->values[i] : nodes->values[i];
+        uint32_t size;
+
+        if (nodes->raw_data[i] && !state->dirty[i]) { // unmodified (or never even read), will be copied as-is
+            state->packed_sizes[i] = get_node_raw_size(nodes, i);
+            continue;
+        }
+
+        if (type < 4 || (type == 4 && value == 0)) {
+            // length = 0, purpose unknown (or an int with a value of 0)
+            size = 1;
+
+        } else if (type <= 12) {
+            // int, 1 - 8 bytes
+            size = 1 + get_signed_byte_size(value);
+
+        } else if (type <= 20) {
+            // arrays of ints can't be modified, they are always copied as-is
+            assert(0);
+            size = 0;
+
+        } else if (type <= 28) {
+            // index into strings or chunks array, 1-4 bytes
+            size = 1 + get_unsigned_byte_size(value);
+
+        } else if (type == 29) {
+            // 0 byte float
+            size = 1;
+
+        } else if (type == 30) {
+            // 4 byte float
+            size = 5;
+
+        } else if (type == 31) {
+            // 8 byte double
+            size = 9;
+
+        } else {
+            // type 32: array of offsets of objects, followed by the objects
+            // type 33: array of int name indexes, array of int offsets, followed by objects
+            uint32_t children_size = 0;
+            uint32_t last_offset = 0;
+            for (uint32_t child = nodes->first_children[i]; child < nodes->first_children[i] + nodes->lengths[i]; child++) {
+                last_offset = children_size;
+                children_size += state->packed_sizes[child];
+            }
+
+            state->packed_widths[i] = get_unsigned_byte_size(last_offset);
+            size = 1 + get_packed_int_array_size(nodes->lengths[i], state->packed_widths[i]) + children_size;
+            if (type == 33) {
+                state->packed_name_widths[i] = get_int_array_width(&nodes->name_indexes[nodes->first_children[i]], nodes->lengths[i]);
+                size += get_packed_int_array_size(nodes->lengths[i], state->packed_name_widths[i]);
+            }
+        }
+
+        state->packed_sizes[i] = size;
+    }
+
+    return state->packed_sizes[0];
+}
+
+// Emit pass of the serializer: packs the entries into out, which needs room for get_packed_entries_size bytes.
+// This is a forward scan over the node table; every node that is packed anew decides where its children go.
+// Returns the position right behind the packed entries.
+Byte *pack_entries(psb_nodes *nodes, psb_pack_state *state, Byte *out)
+{
+    uint32_t *positions = malloc(nodes->amount * sizeof(uint32_t)); // where each node goes, relative to out
+    positions[0] = 0;
+
+    for (uint32_t i = 0; i < nodes->amount; i++) {
+        if (i != 0 && !state->dirty[nodes->parents[i]]) { // part of the raw bytes of an unmodified node
+            continue;
+        }
+        uint8_t type = nodes->types[i];
+        uint64_t value = state->dirty[i] ? state->values[i] : nodes->values[i];
+        Byte *position = &out[positions[i]];
+
+        if (debug) {
+            printf("Now starting to pack node %u with type %d.\n", i, type);
+        }
+
+        if (nodes->raw_data[i] && !state->dirty[i]) {
+            memcpy(position, nodes->raw_data[i], state->packed_sizes[i]);
+            continue;
+        }
+
+        if (type < 4 || (type == 4 && value == 0) || type == 29) {
+            *position = type;
+
+        } else if (type <= 12) {
+            // it works, I hope; even if it looks weird
+            int size = state->packed_sizes[i] - 1;
+            *position++ = size + 4;
+            memcpy(position, &value, size);
+
+        } else if (type <= 28) {
+            int size = state->packed_sizes[i] - 1;
+            *position++ = size + (type <= 24 ? 20 : 24);
+            memcpy(position, &value, size);
+
+        } else if (type == 30) {
+            *position++ = type;
+            memcpy(position, &value, 4);
+
+        } else if (type == 31) {
+            *position++ = type;
+            memcpy(position, &value, 8);
+
+        } else {
+            *position++ = type;
+            uint32_t first_child = nodes->first_children[i];
+            uint32_t child_amount = nodes->lengths[i];
+
+            if (type == 33) {
+                position = pack_int_array_header(position, child_amount, state->packed_name_widths[i]);
+                position = encode_int_array(position, &nodes->name_indexes[first_child], child_amount, state->packed_name_widths[i]);
+            }
+
+            // the offsets follow directly from the (already known) sizes of the children
+            uint32_t next_offset = 0;
+            for (uint32_t child = first_child; child < first_child + child_amount; child++) {
+                positions[child] = next_offset;
+                next_offset += state->packed_sizes[child];
+            }
+            position = pack_int_array_header(position, child_amount, state->packed_widths[i]);
+            position = encode_int_array(position, &positions[first_child], child_amount, state->packed_widths[i]);
+
+            // the children themselves follow behind the offsets, they get packed once the scan reaches them
+            uint32_t children_start = position - out;
+            for (uint32_t child = first_child; child < first_child + child_amount; child++) {
+                positions[child] += children_start;
+            }
+        }
+    }
+
+    free(positions);
+    return out + state->packed_sizes[0];
+}
+
+
+
+// Reads the node whose raw data is already set. The children of type 32/33 are left alone until expand_psb_node.
+void read_psb_node(psb_data *my_psb_data, uint32_t node)
+{
+    psb_nodes *nodes = &my_psb_data->entries;
+    const Byte *start = nodes->raw_data[node];
+    const Byte *pointer = start + 1;
+    uint8_t type = *start;
+
+    if (debug) {
+        printf("Current offset value: %d\n", type);
+    }
+
+    if (type == 0 || type > 33) {
+        fprintf(stderr, "Error when extracting: Unknown type %d.\n", type);
+        fprintf(stderr, "will exit now just in case.");
+        exit(EXIT_FAILURE);
+    }
+
+    nodes->types[node] = type;
+    nodes->values[node] = 0;
+    nodes->lengths[node] = 0;
+    nodes->first_children[node] = NO_NODE;
+
+    if (type <= 4) {
+        // length = 0, purpose unknown
 
-        return_type_value->value.integer = 0;  // initialization
-        memcpy(&return_type_value->value.integer, *pointer, type - 20);
+    } else if (type <= 12) {
+        // long, 1-8 bytes
+        memcpy(&nodes->values[node], pointer, type - 4);
+
+    } else if (type <= 20) {
+        // array of ints, in the form "size of count, count, size of entries, entries[]"; the entries stay where they are
+        int_array_view array;
+        read_int_array(start, &array);
+        nodes->lengths[node] = array.count;
+
+    } else if (type <= 24) {
+        // index into strings array, 1-4 bytes
+        memcpy(&nodes->values[node], pointer, type - 20);
 
     } else if (type <= 28) {
         // index into chunk array, 1-4 bytes
         // warning: so far untested
-
-        return_type_value->value.integer = 0;  // initialization
-        memcpy(&return_type_value->value.integer, *pointer, type - 24);
+        memcpy(&nodes->values[node], pointer, type - 24);
 
     } else if (type == 29) {
         // float, 0 bytes?
 
-        return_type_value->value.float_value = 0.0f; // just set it to 0 w/e
-
     } else if (type == 30) {
         // float, 4 bytes
-
-        memcpy(&return_type_value->value.float_value, *pointer, 4);
-        (*pointer) += 4; // The pointer probably isn't used by the calling function, but we'll set it for consistency
+        memcpy(&nodes->values[node], pointer, 4);
 
     } else if (type == 31) {
         // double, 8 bytes
+        memcpy(&nodes->values[node], pointer, 8);
+
+    } else {
+        // type 32: array of offsets of objects, followed by the objects
+        // type 33: array of int name indexes, array of int offsets, followed by objects
+        int_array_view offsets;
+        if (type == 33) {
+            int_array_view names;
+            pointer = read_int_array(pointer, &names);
+            read_int_array(pointer, &offsets);
+            assert(names.count == offsets.count);
+        } else {
+            read_int_array(pointer, &offsets);
+        }
+        nodes->lengths[node] = offsets.count;
+    }
+}
+
+// Adds the children of a type 32/33 node to the table, if that hasn't happened yet. The children themselves aren't read.
+void expand_psb_node(psb_data *my_psb_data, uint32_t node)
+{
+    psb_nodes *nodes = &my_psb_data->entries;
+    if (nodes->types[node] == 0) {
+        read_psb_node(my_psb_data, node);
+    }
+    if (nodes->types[node] < 32 || nodes->first_children[node] != NO_NODE) {
+        return;
+    }
+
+    uint8_t type = nodes->types[node];
+    const Byte *pointer = nodes->raw_data[node] + 1;
+    int_array_view names = {0};
+    int_array_view offsets;
+    if (type == 33) {
+        pointer = read_int_array(pointer, &names);
+    }
+    pointer = read_int_array(pointer, &offsets);
+
+    uint32_t first_child = add_psb_nodes(nodes, offsets.count);
+    nodes->first_children[node] = first_child;
+    uint32_t *child_offsets = malloc(offsets.count * sizeof(uint32_t));
+    decode_int_array(&offsets, child_offsets);
+    for (uint32_t i = 0; i < offsets.count; i++) {
+        nodes->raw_data[first_child + i] = pointer + child_offsets[i];
+        nodes->parents[first_child + i] = node;
+    }
+    free(child_offsets);
+
+    if (type == 33) {
+        decode_int_array(&names, &nodes->name_indexes[first_child]);
+        if (debug) {
+            for (uint32_t i = 0; i < names.count; i++) {
+                printf("name string[%d]: %s\n", i, my_psb_data->names[nodes->name_indexes[first_child + i]]);
+            }
+        }
+    }
+}
 
-        memcpy(&return_type_value->value.double_value, *pointer, 8);
-        (*pointer) += 8; // The pointer probably isn't used by the calling function, but we'll set it for consistency
+// Sets up the node table of my_psb_data as a view of the entries at the given position; only the root node is added
+void open_psb_entries(psb_data *my_psb_data, const Byte *entries)
+{
+    psb_nodes *nodes = &my_psb_data->entries;
+    memset(nodes, 0, sizeof(psb_nodes));
+    add_psb_nodes(nodes, 1);
+    nodes->raw_data[0] = entries;
+    nodes->parents[0] = NO_NODE;
+}
+
+// Finds the file_info object in the entries and fills my_psb_data->file_info with its entries; returns 0 if there is none
+_Bool read_file_info(psb_data *my_psb_data)
+{
+    psb_cursor file_info_object = cursor_find(cursor_root(my_psb_data), "file_info");
+    if (!cursor_valid(file_info_object) || cursor_type(file_info_object) != 33) {
+        fprintf(stderr, "Error: the psb doesn't contain a file_info object.\n");
+        return 0;
+    }
+    printf("FILE INFO DETECTED!\n");
+
+    my_psb_data->file_info_amount = cursor_length(file_info_object);
+    my_psb_data->file_info = arena_alloc(my_psb_data->arena, my_psb_data->file_info_amount * sizeof(file_info));
+    for (uint32_t i = 0; i < my_psb_data->file_info_amount; i++) {
+        psb_cursor entry = cursor_child(file_info_object, i);
+
+        // sanity check the file_info entry
+        assert(cursor_type(entry) == 32);
+        assert(cursor_length(entry) == 2);
+        assert(cursor_type(cursor_child(entry, 0)) >= 4);
+        assert(cursor_type(cursor_child(entry, 0)) <= 12);
+        assert(cursor_type(cursor_child(entry, 1)) >= 4);
+        assert(cursor_type(cursor_child(entry, 1)) <= 12);
+
+        my_psb_data->file_info[i].name_index = entry.psb->entries.name_indexes[entry.node];
+        my_psb_data->file_info[i].offset_node = cursor_child(entry, 0).node;
+        my_psb_data->file_info[i].length_node = cursor_child(entry, 1).node;
+    }
+    return 1;
+}
 
-    } else if (type == 32) {
-        // array of objects
-        // array of offsets of objects, followed by the objects
+static int compare_file_info_names(const void *a, const void *b, void *context)
+{
+    psb_data *my_psb_data = context;
+    return strcmp(my_psb_data->names[my_psb_data->file_info[*(const uint32_t *) a].name_index],
+                  my_psb_data->names[my_psb_data->file_info[*(const uint32_t *) b].name_index]);
+}
 
-        type_value *offsets = extract_data(NULL, pointer, NULL);
+// Builds the lookup structures for find_file_info and find_file_info_prefix
+void index_file_info(psb_data *my_psb_data)
+{
+    uint32_t capacity = 16;
+    while (capacity < 2 * my_psb_data->file_info_amount) {
+        capacity *= 2;
+    }
+    my_psb_data->file_info_slots_capacity = capacity;
+    my_psb_data->file_info_slots = arena_calloc(my_psb_data->arena, capacity, sizeof(uint32_t));
+    my_psb_data->file_info_by_name = arena_alloc(my_psb_data->arena, my_psb_data->file_info_amount * sizeof(uint32_t));
+
+    for (uint32_t i = 0; i < my_psb_data->file_info_amount; i++) {
+        const char *name = my_psb_data->names[my_psb_data->file_info[i].name_index];
+        uint32_t slot = hash_string(name, strlen(name)) & (capacity - 1);
+        while (my_psb_data->file_info_slots[slot]) {
+            slot = (slot + 1) & (capacity - 1);
+        }
+        my_psb_data->file_info_slots[slot] = i + 1;
+        my_psb_data->file_info_by_name[i] = i;
+    }
+    qsort_r(my_psb_data->file_info_by_name, my_psb_data->file_info_amount, sizeof(uint32_t), compare_file_info_names, my_psb_data);
+}
 
-        return_type_value->value_length = offsets->value_length;
-        return_type_value->value.type_value_array = malloc(offsets->value_length * sizeof(type_value *));
-        Byte *new_pointer;
-        for (int i = 0; i < offsets->value_length; i++) {
-            int o = offsets->value.integer_array[i];
+// Returns the file_info index of the subfile with the given name, or -1 if there is none
+int find_file_info(psb_data *my_psb_data, const char *name)
+{
+    uint32_t mask = my_psb_data->file_info_slots_capacity - 1;
+    for (uint32_t slot = hash_string(name, strlen(name)) & mask; my_psb_data->file_info_slots[slot]; slot = (slot + 1) & mask) {
+        uint32_t index = my_psb_data->file_info_slots[slot] - 1;
+        if (strcmp(my_psb_data->names[my_psb_data->file_info[index].name_index], name) == 0) {
+            return index;
+        }
+    }
+    return -1;
+}
 
-            new_pointer = (*pointer) + o;
-            type_value *v1 = extract_data(NULL, &new_pointer, NULL);
-            return_type_value->value.type_value_array[i] = v1;
+// Returns how many subfiles have a name starting with prefix; their file_info indexes are file_info_by_name[*first] and onwards
+uint32_t find_file_info_prefix(psb_data *my_psb_data, const char *prefix, uint32_t *first)
+{
+    int prefix_length = strlen(prefix);
+    uint32_t low = 0;
+    uint32_t high = my_psb_data->file_info_amount;
+    while (low < high) { // first name that isn't smaller than prefix
+        uint32_t middle = low + (high - low) / 2;
+        if (strcmp(my_psb_data->names[my_psb_data->file_info[my_psb_data->file_info_by_name[middle]].name_index], prefix) < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    *first = low;
+
+    high = my_psb_data->file_info_amount;
+    while (low < high) { // first name behind that which doesn't start with prefix anymore
+        uint32_t middle = low + (high - low) / 2;
+        if (strncmp(my_psb_data->names[my_psb_data->file_info[my_psb_data->file_info_by_name[middle]].name_index], prefix, prefix_length) == 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
         }
-        free(offsets->value.integer_array);
-        free(offsets);
+    }
+    return low - *first;
+}
 
-    } else if (type == 33) {
-        // array of name-objects
-        // array of int name indexes, array of int offsets, followed by objects
 
-        assert(my_psb_data);
+// state for copying ranges of the input bin to the output bin; the cheaper methods get turned off once they turn out to be unsupported
+struct _bin_copier {
+    int in_file;
+    const Byte *in_map;
+    uint64_t in_size;
+    int out_file;
+    uint64_t block_size; // reflinks can only be made of whole filesystem blocks
+    _Bool can_clone;
+    _Bool can_copy_file_range;
+    _Bool can_sendfile;
+    uint64_t bytes_cloned;
+    uint64_t bytes_copied;
+    uint64_t bytes_written;
+    _Bool failed; // a write went wrong, nothing more gets written then
+};
 
-        type_value *names = extract_data(NULL, pointer, NULL);
-        type_value *offsets = extract_data(NULL, pointer, NULL);
+typedef struct _bin_copier bin_copier;
 
-        if (debug) {
-            for (int i = 0; i < names->value_length; i++) {
-                printf("name string[%d]: %s\n", i, my_psb_data->names[names->value.integer_array[i]]);
+// returns 0 if the data couldn't be written completely
+static _Bool write_all(int out_file, const Byte *data, uint64_t length, uint64_t offset)
+{
+    while (length) {
+        ssize_t written = pwrite(out_file, data, length, offset);
+        if (written <= 0) {
+            if (written == -1 && errno == EINTR) {
+                continue;
             }
-            for (int i = 0; i < offsets->value_length; i++) {
-                printf("offsets[%d]: %d\n", i, offsets->value.integer_array[i]);
+            return 0;
+        }
+        data += written;
+        offset += written;
+        length -= written;
+    }
+    return 1;
+}
+
+// Copies length bytes of in_file at in_offset to out_file at out_offset (both may be the same file and range), xor'ing them
+// with xor_key (if not NULL) as if the first one was at key_position of the xor'd stream. *crc (if not NULL) gets updated with
+// the bytes as they were read. Only a small buffer is used; without xor and crc the copy is left to the kernel if possible.
+// Returns 0 if something couldn't be read or written.
+static _Bool copy_payload(int in_file, uint64_t in_offset, int out_file, uint64_t out_offset, uint64_t length, const Byte *xor_key, uLong key_position, uLong *crc)
+{
+#ifdef __linux__
+    while (length && !xor_key && !crc) {
+        loff_t in_position = in_offset;
+        loff_t out_position = out_offset;
+        ssize_t copied = copy_file_range(in_file, &in_position, out_file, &out_position, length, 0);
+        if (copied <= 0) {
+            break;
+        }
+        in_offset += copied;
+        out_offset += copied;
+        length -= copied;
+    }
+#endif
+    if (length == 0) {
+        return 1;
+    }
+    Byte *buffer = malloc(MDF_CHUNK_SIZE);
+    while (length) {
+        ssize_t read_size = pread(in_file, buffer, length < MDF_CHUNK_SIZE ? length : MDF_CHUNK_SIZE, in_offset);
+        if (read_size <= 0) {
+            if (read_size == -1 && errno == EINTR) {
+                continue;
             }
+            break;
         }
+        if (crc) {
+            *crc = crc32(*crc, buffer, read_size);
+        }
+        if (xor_key) {
+            xor_data_with_key(buffer, xor_key, read_size, key_position);
+            key_position += read_size;
+        }
+        if (!write_all(out_file, buffer, read_size, out_offset)) {
+            break;
+        }
+        in_offset += read_size;
+        out_offset += read_size;
+        length -= read_size;
+    }
+    free(buffer);
+    return length == 0;
+}
 
-        assert(names->value_length == offsets->value_length);
+// copies the range with copy_file_range, sendfile, or (if neither works) by writing out the mapped data
+static void copy_bin_range_uncloned(bin_copier *copier, uint64_t in_offset, uint64_t out_offset, uint64_t length)
+{
+    if (copier->failed) {
+        return;
+    }
+#ifdef __linux__
+    while (length && copier->can_copy_file_range) {
+        loff_t in_position = in_offset;
+        loff_t out_position = out_offset;
+        ssize_t copied = copy_file_range(copier->in_file, &in_position, copier->out_file, &out_position, length, 0);
+        if (copied <= 0) { // ENOSYS, EXDEV etc.
+            copier->can_copy_file_range = 0;
+            break;
+        }
+        in_offset += copied;
+        out_offset += copied;
+        length -= copied;
+        copier->bytes_copied += copied;
+    }
+    while (length && copier->can_sendfile) {
+        off_t in_position = in_offset;
+        ssize_t copied = -1;
+        if (lseek(copier->out_file, out_offset, SEEK_SET) != -1) {
+            copied = sendfile(copier->out_file, copier->in_file, &in_position, length);
+        }
+        if (copied <= 0) {
+            copier->can_sendfile = 0;
+            break;
+        }
+        in_offset += copied;
+        out_offset += copied;
+        length -= copied;
+        copier->bytes_copied += copied;
+    }
+#endif
+    if (length) {
+        copier->failed |= !write_all(copier->out_file, &copier->in_map[in_offset], length, out_offset);
+        copier->bytes_written += length;
+    }
+}
 
-        _Bool is_file_info = 0;
-        if (return_count && *return_count == 1) {
-            is_file_info = 1;
-            printf("FILE INFO DETECTED!\n");
-            my_psb_data->file_info = malloc(names->value_length * sizeof(file_info));
-            my_psb_data->file_info_amount = names->value_length;
+// Copies length bytes of the input bin at in_offset to out_offset in the output bin.
+// Whole filesystem blocks get reflinked if the filesystem supports it, everything else is copied.
+static void copy_bin_range(bin_copier *copier, uint64_t in_offset, uint64_t out_offset, uint64_t length)
+{
+#ifdef __linux__
+    if (copier->can_clone && !copier->failed && length && in_offset % copier->block_size == out_offset % copier->block_size) {
+        uint64_t head_length = (copier->block_size - in_offset % copier->block_size) % copier->block_size;
+        uint64_t clone_length = 0;
+        if (head_length < length) {
+            clone_length = (length - head_length) / copier->block_size * copier->block_size;
+            if (in_offset + length == copier->in_size) { // the last block of the source file can be cloned even if it isn't complete
+                clone_length = length - head_length;
+            }
+        }
+        if (clone_length) {
+            struct file_clone_range clone_range = {
+                .src_fd = copier->in_file,
+                .src_offset = in_offset + head_length,
+                .src_length = clone_length,
+                .dest_offset = out_offset + head_length
+            };
+            if (ioctl(copier->out_file, FICLONERANGE, &clone_range) == 0) {
+                copy_bin_range_uncloned(copier, in_offset, out_offset, head_length);
+                copier->bytes_cloned += clone_length;
+                uint64_t tail_start = head_length + clone_length;
+                copy_bin_range_uncloned(copier, in_offset + tail_start, out_offset + tail_start, length - tail_start);
+                return;
+            }
+            if (errno != EINVAL) { // EINVAL only means this range couldn't be cloned, everything else means no reflinks at all
+                copier->can_clone = 0;
+            }
         }
+    }
+#endif
+    copy_bin_range_uncloned(copier, in_offset, out_offset, length);
+}
 
-        return_type_value->value_length = names->value_length;
-        return_type_value->value.name_object_array = malloc(names->value_length * sizeof(name_object *));
+uint64_t align_to_2048(uint64_t value)
+{
+    return (value + 2047) / 2048 * 2048;
+}
+
+// Returns 0 if the bin couldn't be written; the old bin (if there is one) is left as it was then.
+_Bool pack_bin(psb_injection *injection, const char *out_file)
+{
+    psb_data *template = injection->template;
+    int out_file_length = strlen(out_file);
+    char out_bin_name[out_file_length - 1];
+    memcpy(out_bin_name, out_file, out_file_length - 6);
+    strcpy(&out_bin_name[out_file_length - 6], ".bin");
+
+    // the unchanged subfiles are still mapped from the input bin, which might be the very file we are about to write.
+    // so we write to a temporary file and rename it afterwards, which leaves the mapped (old) file intact until we're done.
+    char temp_bin_name[out_file_length + 3];
+    sprintf(temp_bin_name, "%s.tmp", out_bin_name);
+
+    int out_bin_file = open(temp_bin_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out_bin_file == -1) {
+        fprintf(stderr, "Error: Couldn't open output bin file (%s).\n", temp_bin_name);
+        return 0;
+    }
+    printf("Writing out bin file \"%s\".\n", out_bin_name);
+
+    struct stat out_stat;
+    fstat(out_bin_file, &out_stat);
+    bin_copier copier = {
+        .in_file = template->bin_file,
+        .in_map = template->bin_map,
+        .in_size = template->bin_map_size,
+        .out_file = out_bin_file,
+        .block_size = out_stat.st_blksize > 0 ? out_stat.st_blksize : 4096,
+        .can_clone = 1,
+        .can_copy_file_range = 1,
+        .can_sendfile = 1
+    };
+
+    // subfiles are placed at their offsets; the alignment padding is left as a hole (or copied along) and reads back as zeros
+    uint64_t bin_size = 0;
+    int i = 0;
+    while (i < template->file_info_amount) {
+        uint64_t out_offset = injection->offsets[i];
+
+        if (injection->replaced_files[i] != -1) {
+            if (!copier.failed) {
+                copier.failed = !copy_payload(injection->replaced_files[i], 0, out_bin_file, out_offset, injection->lengths[i], NULL, 0, NULL);
+            }
+            copier.bytes_written += injection->lengths[i];
+            bin_size = align_to_2048(out_offset + injection->lengths[i]);
+            i++;
+            continue;
+        }
+
+        // unchanged subfiles that kept their position relative to each other are copied as one range, padding included
+        uint64_t in_offset = get_file_info_offset(template, i);
+        int last = i;
+        while (last + 1 < template->file_info_amount && injection->replaced_files[last+1] == -1
+            && get_file_info_offset(template, last+1) - in_offset == injection->offsets[last+1] - out_offset) {
+            last++;
+        }
+        uint64_t range_length = get_file_info_offset(template, last) + injection->lengths[last] - in_offset;
+        uint64_t out_end = out_offset + range_length;
+
+        // take the padding of the last subfile along as well, as long as it's the same in both files
+        uint64_t padding_length = align_to_2048(out_end) - out_end;
+        if ((in_offset + range_length) % 2048 != out_end % 2048 || in_offset + range_length + padding_length > template->bin_map_size) {
+            padding_length = 0;
+        }
+        copy_bin_range(&copier, in_offset, out_offset, range_length + padding_length);
+
+        bin_size = align_to_2048(out_end);
+        i = last + 1;
+    }
+
+    _Bool failed = copier.failed || ftruncate(out_bin_file, bin_size) != 0;
+    failed |= close(out_bin_file) != 0;
+    if (failed || rename(temp_bin_name, out_bin_name) != 0) {
+        fprintf(stderr, "Error: Couldn't write output bin file (%s).\n", out_bin_name);
+        unlink(temp_bin_name);
+        return 0;
+    }
+    printf("bin file: %"PRIu64" bytes cloned, %"PRIu64" bytes copied, %"PRIu64" bytes written.\n", copier.bytes_cloned, copier.bytes_copied, copier.bytes_written);
+    return 1;
+}
+
+// Whether every replaced subfile fits into its slot in the bin (the space up to the next subfile; the last one can grow the
+// file), so that patch_bin_in_place can write them without moving anything else.
+_Bool fits_in_place(psb_injection *injection)
+{
+    psb_data *template = injection->template;
+    for (int i = 0; i < template->file_info_amount; i++) {
+        if (injection->replaced_files[i] != -1 && i + 1 < template->file_info_amount
+            && get_file_info_offset(template, i) + injection->lengths[i] > get_file_info_offset(template, i + 1)) {
+            printf("\"%s\" doesn't fit into its old place, the bin file gets rewritten.\n", template->names[template->file_info[i].name_index]);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Writes the replaced subfiles straight into the existing bin file at their current offsets; only valid if fits_in_place.
+// Nothing else of the bin is touched, the offsets stay as they are.
+// Unlike pack_bin this isn't atomic: if it fails or gets interrupted, the bin doesn't match the psb.m anymore.
+// Returns 0 if the bin couldn't be written.
+_Bool patch_bin_in_place(psb_injection *injection, const char *out_file)
+{
+    psb_data *template = injection->template;
+    int out_file_length = strlen(out_file);
+    char out_bin_name[out_file_length - 1];
+    memcpy(out_bin_name, out_file, out_file_length - 6);
+    strcpy(&out_bin_name[out_file_length - 6], ".bin");
+    int out_bin_file = open(out_bin_name, O_WRONLY);
+    if (out_bin_file == -1) {
+        fprintf(stderr, "Error: Couldn't open output bin file (%s).\n", out_bin_name);
+        return 0;
+    }
+    printf("Patching bin file \"%s\" in place.\n", out_bin_name);
+
+    uint64_t bytes_written = 0;
+    Byte zeros[2048] = {0};
+    _Bool failed = 0;
+    for (int i = 0; i < template->file_info_amount && !failed; i++) {
+        if (injection->replaced_files[i] == -1) {
+            continue;
+        }
+        uint64_t offset = injection->offsets[i];
+        uint64_t new_end = offset + injection->lengths[i];
+        if (!copy_payload(injection->replaced_files[i], 0, out_bin_file, offset, injection->lengths[i], NULL, 0, NULL)) {
+            failed = 1;
+            break;
+        }
+        bytes_written += injection->lengths[i];
+
+        if (i + 1 == template->file_info_amount) { // the last subfile decides where the file ends
+            failed = ftruncate(out_bin_file, align_to_2048(new_end)) != 0;
+            continue;
+        }
+        // the padding behind the new data and whatever is left of the old data become zeros
+        uint64_t old_end = get_file_info_offset(template, i) + get_file_info_length(template, i);
+        uint64_t zero_end = old_end > align_to_2048(new_end) ? old_end : align_to_2048(new_end);
+        if (zero_end > get_file_info_offset(template, i + 1)) {
+            zero_end = get_file_info_offset(template, i + 1);
+        }
+        for (uint64_t position = new_end; position < zero_end; position += sizeof(zeros)) {
+            uint64_t length = zero_end - position < sizeof(zeros) ? zero_end - position : sizeof(zeros);
+            if (!write_all(out_bin_file, zeros, length, position)) {
+                failed = 1;
+                break;
+            }
+            bytes_written += length;
+        }
+    }
+
+    failed |= close(out_bin_file) != 0;
+    if (failed) {
+        fprintf(stderr, "Error: Couldn't write to the bin file (%s), it doesn't match the psb.m anymore.\n", out_bin_name);
+        return 0;
+    }
+    printf("bin file: %"PRIu64" bytes written in place.\n", bytes_written);
+    return 1;
+}
+
+
+// Writes the psb.m of the injection to file_name; returns 0 if it couldn't be written.
+static _Bool write_psb_file(psb_injection *injection, const char *file_name)
+{
+    psb_data *template = injection->template;
+
+    // I will pack in a relatively lazy way, by re-using raw data saved earlier
+    // everything should still work perfectly fine though
+
+    // the entries get sized first, so that the whole psb can be written into a single buffer of the final size
+    psb_pack_state state;
+    init_pack_state(injection, &state);
+    uint32_t size_entry_data = get_packed_entries_size(&template->entries, &state);
+
+    // the header of the template stays as it is, the changed offsets only go into this copy
+    psb_header header = *template->header;
+
+    int64_t offset_difference = (int64_t) header.offset_entries + size_entry_data - header.offset_strings;
+    if (offset_difference != 0) {
+        printf("updating offsets; filesize differs by %"PRId64".\n", offset_difference);
+        if (offset_difference > 1 || offset_difference < -1) {
+            fprintf(stderr, "The filesize difference was larger than 1. I believe that this should not happen. If issues occur, it's likely due to this.\n");
+        }
+        header.offset_strings += offset_difference;
+        header.offset_strings_data += offset_difference;
+        header.offset_chunk_offsets += offset_difference;
+        header.offset_chunk_lengths += offset_difference;
+        header.offset_chunk_data += offset_difference;
+    }
+
+    // header, names, entries, strings and chunks in that order
+    uint32_t injected_psb_data_size = 40 + template->raw_psb_data->raw_names_size + size_entry_data + template->raw_psb_data->raw_strings_size + 6;
+    Byte *injected_psb_data = malloc(injected_psb_data_size);
+
+    // pack the header
+    memcpy(injected_psb_data, header.signature, 4);
+    memcpy(&injected_psb_data[4], &header.type, 4);
+    memcpy(&injected_psb_data[8], &header.unknown1, 4);
+    memcpy(&injected_psb_data[12], &header.offset_names, 4);
+    memcpy(&injected_psb_data[16], &header.offset_strings, 4);
+    memcpy(&injected_psb_data[20], &header.offset_strings_data, 4);
+    memcpy(&injected_psb_data[24], &header.offset_chunk_offsets, 4);
+    memcpy(&injected_psb_data[28], &header.offset_chunk_lengths, 4);
+    memcpy(&injected_psb_data[32], &header.offset_chunk_data, 4);
+    memcpy(&injected_psb_data[36], &header.offset_entries, 4);
+    Byte *position = &injected_psb_data[40];
+
+    // pack_names function
+    // instead of packing manually, we just use our raw_names
+    memcpy(position, template->raw_psb_data->raw_names, template->raw_psb_data->raw_names_size);
+    position += template->raw_psb_data->raw_names_size;
+
+    // pack_entries function
+    position = pack_entries(&template->entries, &state, position);
+    free_pack_state(&state);
+
+    // pack_strings function
+    // we'll use our raw strings again
+    memcpy(position, template->raw_psb_data->raw_strings, template->raw_psb_data->raw_strings_size);
+    position += template->raw_psb_data->raw_strings_size;
+
+    // pack_chunks function
+    // because I believe alldata.psbs ALWAYS have absolutely no chunk data, we will append the according "empty" bytes
+    memcpy(position, "\x0d\x00\x0d\x0d\x00\x0d", 6);
+    position += 6;
+    assert(position == &injected_psb_data[injected_psb_data_size]);
+    printf("injected (uncompressed) psb size: %d\n", injected_psb_data_size);
+
+    if (debug_filewrites) {
+        FILE *debug_file = fopen("__injected_uncompressed_psb_data.psb", "wb");
+        if (debug_file == NULL) {
+            fprintf(stderr, "Error when opening injected psb output file.\n");
+            exit(EXIT_FAILURE);
+        }
+        fwrite(injected_psb_data, injected_psb_data_size, 1, debug_file);
+        fclose(debug_file);
+    }
+
+    uLongf compressed_size = compressBound(injected_psb_data_size);
+    Byte *compressed_injected_psb_data = malloc(8 + compressed_size);
+    memcpy(compressed_injected_psb_data, "mdf\x00", 4);
+    memcpy(&compressed_injected_psb_data[4], &injected_psb_data_size, 4);
+    int return_value = compress2(&compressed_injected_psb_data[8], &compressed_size, injected_psb_data, injected_psb_data_size, 9);
+    if (return_value != Z_OK) {
+        fprintf(stderr, "Error when compressing final psb.m file. The return code was %d. Will now exit.\n", return_value);
+        exit(EXIT_FAILURE);
+    }
+    free(injected_psb_data);
+
+    printf("injected compressed psb size: %lu (+8 for the header)\n", compressed_size);
+    compressed_injected_psb_data = realloc(compressed_injected_psb_data, compressed_size + 8);
+    xor_data(&compressed_injected_psb_data[8], "alldata.psb.m", compressed_size);
+
+    FILE *out_psb_file = fopen(file_name, "wb");
+    if (out_psb_file == NULL) {
+        fprintf(stderr, "Error: Couldn't open output file (%s).\n", file_name);
+        free(compressed_injected_psb_data);
+        return 0;
+    }
+
+    _Bool written = fwrite(compressed_injected_psb_data, compressed_size + 8, 1, out_psb_file) == 1;
+    free(compressed_injected_psb_data);
+    if (fclose(out_psb_file) != 0 || !written) {
+        fprintf(stderr, "Error: Couldn't write output file (%s).\n", file_name);
+        unlink(file_name);
+        return 0;
+    }
+    return 1;
+}
+
+// Writes the psb.m as "<out_name>.tmp" and returns it in *temp_name (malloc'd), to be renamed to out_name with commit_psb
+// once everything else of the output is written as well. Returns 0 (without a temporary file left) if it couldn't be written.
+_Bool prepare_psb(psb_injection *injection, const char *out_name, char **temp_name)
+{
+    printf("Writing out psb.m file \"%s\".\n", out_name);
+    *temp_name = malloc(strlen(out_name) + 5);
+    sprintf(*temp_name, "%s.tmp", out_name);
+    if (!write_psb_file(injection, *temp_name)) {
+        free(*temp_name);
+        return 0;
+    }
+    return 1;
+}
+
+// Replaces out_name with the psb.m written by prepare_psb, or only removes that again if commit is 0; frees temp_name.
+_Bool commit_psb(char *temp_name, const char *out_name, _Bool commit)
+{
+    _Bool success = commit && rename(temp_name, out_name) == 0;
+    if (commit && !success) {
+        fprintf(stderr, "Error: Couldn't write output file (%s).\n", out_name);
+    }
+    if (!success) {
+        unlink(temp_name);
+    }
+    free(temp_name);
+    return success;
+}
+
+// Returns 0 if the psb.m couldn't be written.
+_Bool pack_psb(psb_injection *injection, const char *out_name)
+{
+    char *temp_name;
+    return prepare_psb(injection, out_name, &temp_name) && commit_psb(temp_name, out_name, 1);
+}
+
+
+// A snapshot of a loaded psb is kept as "<psb.m>.snapshot" when --snapshot is used, so later runs neither have to decrypt,
+// uncompress nor decode the psb.m again: the snapshot is mapped, and only the small parts get copied out of it.
+// It starts with a snapshot_header, followed by the sections it lists (each 8 byte aligned). It only belongs to the psb.m
+// with exactly the size, mtime and crc32 in the header, and the crc32 of everything behind the header has to match as well.
+#define SNAPSHOT_MAGIC "PSBSNAP"
+#define SNAPSHOT_VERSION 2
+
+enum snapshot_section {
+    SECTION_RAW_PSB,
+    SECTION_NAME_OFFSETS, // into SECTION_NAMES
+    SECTION_NAMES,
+    SECTION_STRING_OFFSETS, // these and the following offsets are relative to the raw psb
+    SECTION_CHUNK_OFFSETS,
+    SECTION_NODE_TYPES,
+    SECTION_NODE_VALUES,
+    SECTION_NODE_LENGTHS,
+    SECTION_NODE_FIRST_CHILDREN,
+    SECTION_NODE_NAME_INDEXES,
+    SECTION_NODE_PARENTS,
+    SECTION_NODE_RAW_OFFSETS,
+    SECTION_NODE_RAW_SIZES,
+    SECTION_FILE_INFO,
+    SECTION_FILE_INFO_SLOTS,
+    SECTION_FILE_INFO_BY_NAME,
+    SECTION_XOR_KEYS, // the 80 byte key of every file_info entry, so they don't have to be generated again
+    SECTION_AMOUNT
+};
+
+struct _snapshot_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t checksum; // crc32 of everything behind the header
+    psb_source source;
+    psb_header header;
+    uint32_t raw_psb_size;
+    uint32_t names_amount;
+    uint32_t strings_amount;
+    uint32_t chunkdata_size;
+    uint32_t node_amount;
+    uint32_t file_info_amount;
+    uint32_t file_info_slots_capacity;
+    uint32_t raw_names_offset;
+    uint32_t raw_names_size;
+    uint32_t raw_strings_offset;
+    uint32_t raw_strings_size;
+    uint64_t section_offsets[SECTION_AMOUNT];
+    uint64_t section_sizes[SECTION_AMOUNT];
+};
+
+typedef struct _snapshot_header snapshot_header;
+
+// crc32 of a whole file
+static uint32_t get_file_crc(int file)
+{
+    Byte *buffer = malloc(MDF_CHUNK_SIZE);
+    uLong crc = crc32(0, Z_NULL, 0);
+    uint64_t position = 0;
+    ssize_t read_size;
+    while ((read_size = pread(file, buffer, MDF_CHUNK_SIZE, position)) > 0) {
+        crc = crc32(crc, buffer, read_size);
+        position += read_size;
+    }
+    free(buffer);
+    return crc;
+}
+
+// the size, mtime and crc32 of the psb.m; returns 0 if it can't be read
+static _Bool get_psb_source(const char *psb_filename, psb_source *source)
+{
+    int file = open(psb_filename, O_RDONLY);
+    if (file == -1) {
+        return 0;
+    }
+    struct stat file_stat;
+    fstat(file, &file_stat);
+    memset(source, 0, sizeof(psb_source));
+    source->size = file_stat.st_size;
+    source->mtime_sec = file_stat.st_mtim.tv_sec;
+    source->mtime_nsec = file_stat.st_mtim.tv_nsec;
+    source->crc = get_file_crc(file);
+    close(file);
+    return 1;
+}
+
+struct _snapshot_writer {
+    Byte *data;
+    uint64_t size;
+    uint64_t capacity;
+};
+
+static void add_snapshot_section(struct _snapshot_writer *writer, enum snapshot_section section, const void *data, uint64_t size)
+{
+    uint64_t aligned_size = (size + 7) / 8 * 8;
+    if (writer->size + aligned_size > writer->capacity) {
+        while (writer->size + aligned_size > writer->capacity) {
+            writer->capacity *= 2;
+        }
+        writer->data = realloc(writer->data, writer->capacity);
+    }
+    snapshot_header *header = (snapshot_header *) writer->data;
+    header->section_offsets[section] = writer->size;
+    header->section_sizes[section] = size;
+    memcpy(&writer->data[writer->size], data, size);
+    memset(&writer->data[writer->size + size], 0, aligned_size - size);
+    writer->size += aligned_size;
+}
+
+// Writes the snapshot of a freshly parsed psb; it's written to a temporary file first, so other processes never see half of it
+void write_snapshot(psb_data *my_psb_data, const char *psb_filename)
+{
+    // the psb.m could have changed since it got parsed, the snapshot would belong to the wrong file then
+    psb_source source;
+    if (!get_psb_source(psb_filename, &source) || source.size != my_psb_data->source.size
+        || source.mtime_sec != my_psb_data->source.mtime_sec || source.mtime_nsec != my_psb_data->source.mtime_nsec) {
+        return;
+    }
+
+    struct _snapshot_writer writer = {calloc(1, 1024 * 1024), (sizeof(snapshot_header) + 7) / 8 * 8, 1024 * 1024};
+    const Byte *raw_psb = my_psb_data->raw_psb_data->raw_psb;
+    psb_nodes *nodes = &my_psb_data->entries;
+
+    add_snapshot_section(&writer, SECTION_RAW_PSB, raw_psb, my_psb_data->raw_psb_data->raw_psb_size);
+
+    uint32_t *offsets = malloc((my_psb_data->names_amount + my_psb_data->strings_amount + my_psb_data->chunkdata_size + nodes->amount + 1) * sizeof(uint32_t));
+    uint32_t names_size = 0;
+    for (uint32_t i = 0; i < my_psb_data->names_amount; i++) {
+        offsets[i] = names_size;
+        names_size += strlen(my_psb_data->names[i]) + 1;
+    }
+    add_snapshot_section(&writer, SECTION_NAME_OFFSETS, offsets, my_psb_data->names_amount * sizeof(uint32_t));
+    char *names = malloc(names_size + 1);
+    for (uint32_t i = 0; i < my_psb_data->names_amount; i++) {
+        strcpy(&names[offsets[i]], my_psb_data->names[i]);
+    }
+    add_snapshot_section(&writer, SECTION_NAMES, names, names_size);
+    free(names);
+
+    for (uint32_t i = 0; i < my_psb_data->strings_amount; i++) {
+        offsets[i] = (Byte *) my_psb_data->strings[i] - raw_psb;
+    }
+    add_snapshot_section(&writer, SECTION_STRING_OFFSETS, offsets, my_psb_data->strings_amount * sizeof(uint32_t));
+    for (uint32_t i = 0; i < my_psb_data->chunkdata_size; i++) {
+        offsets[i] = my_psb_data->chunkdata[i] - raw_psb;
+    }
+    add_snapshot_section(&writer, SECTION_CHUNK_OFFSETS, offsets, my_psb_data->chunkdata_size * sizeof(uint32_t));
+
+    add_snapshot_section(&writer, SECTION_NODE_TYPES, nodes->types, nodes->amount * sizeof(uint8_t));
+    add_snapshot_section(&writer, SECTION_NODE_VALUES, nodes->values, nodes->amount * sizeof(uint64_t));
+    add_snapshot_section(&writer, SECTION_NODE_LENGTHS, nodes->lengths, nodes->amount * sizeof(uint32_t));
+    add_snapshot_section(&writer, SECTION_NODE_FIRST_CHILDREN, nodes->first_children, nodes->amount * sizeof(uint32_t));
+    add_snapshot_section(&writer, SECTION_NODE_NAME_INDEXES, nodes->name_indexes, nodes->amount * sizeof(uint32_t));
+    add_snapshot_section(&writer, SECTION_NODE_PARENTS, nodes->parents, nodes->amount * sizeof(uint32_t));
+    for (uint32_t i = 0; i < nodes->amount; i++) {
+        offsets[i] = nodes->raw_data[i] - raw_psb;
+    }
+    add_snapshot_section(&writer, SECTION_NODE_RAW_OFFSETS, offsets, nodes->amount * sizeof(uint32_t));
+    add_snapshot_section(&writer, SECTION_NODE_RAW_SIZES, nodes->raw_sizes, nodes->amount * sizeof(uint32_t));
+    free(offsets);
+
+    add_snapshot_section(&writer, SECTION_FILE_INFO, my_psb_data->file_info, my_psb_data->file_info_amount * sizeof(file_info));
+    add_snapshot_section(&writer, SECTION_FILE_INFO_SLOTS, my_psb_data->file_info_slots, my_psb_data->file_info_slots_capacity * sizeof(uint32_t));
+    add_snapshot_section(&writer, SECTION_FILE_INFO_BY_NAME, my_psb_data->file_info_by_name, my_psb_data->file_info_amount * sizeof(uint32_t));
+    Byte *xor_keys = malloc(my_psb_data->file_info_amount * 80 + 1);
+    for (uint32_t i = 0; i < my_psb_data->file_info_amount; i++) {
+        get_xor_key(my_psb_data->names[my_psb_data->file_info[i].name_index], &xor_keys[i * 80]);
+    }
+    add_snapshot_section(&writer, SECTION_XOR_KEYS, xor_keys, my_psb_data->file_info_amount * 80);
+    free(xor_keys);
+
+    snapshot_header *header = (snapshot_header *) writer.data;
+    memcpy(header->magic, SNAPSHOT_MAGIC, 8);
+    header->version = SNAPSHOT_VERSION;
+    header->source = source;
+    header->header = *my_psb_data->header;
+    header->raw_psb_size = my_psb_data->raw_psb_data->raw_psb_size;
+    header->names_amount = my_psb_data->names_amount;
+    header->strings_amount = my_psb_data->strings_amount;
+    header->chunkdata_size = my_psb_data->chunkdata_size;
+    header->node_amount = nodes->amount;
+    header->file_info_amount = my_psb_data->file_info_amount;
+    header->file_info_slots_capacity = my_psb_data->file_info_slots_capacity;
+    header->raw_names_offset = my_psb_data->raw_psb_data->raw_names - raw_psb;
+    header->raw_names_size = my_psb_data->raw_psb_data->raw_names_size;
+    header->raw_strings_offset = my_psb_data->raw_psb_data->raw_strings - raw_psb;
+    header->raw_strings_size = my_psb_data->raw_psb_data->raw_strings_size;
+    uint64_t header_size = (sizeof(snapshot_header) + 7) / 8 * 8;
+    header->checksum = crc32(0, &writer.data[header_size], writer.size - header_size);
+
+    int name_length = strlen(psb_filename);
+    char snapshot_name[name_length + 10];
+    char temp_snapshot_name[name_length + 30];
+    sprintf(snapshot_name, "%s.snapshot", psb_filename);
+    sprintf(temp_snapshot_name, "%s.snapshot.%ld.tmp", psb_filename, (long) getpid());
+    FILE *snapshot_file = fopen(temp_snapshot_name, "wb");
+    if (snapshot_file == NULL) {
+        fprintf(stderr, "Warning: couldn't write the snapshot \"%s\".\n", snapshot_name);
+        free(writer.data);
+        return;
+    }
+    _Bool written = fwrite(writer.data, writer.size, 1, snapshot_file) == 1;
+    if (fclose(snapshot_file) != 0 || !written || rename(temp_snapshot_name, snapshot_name) != 0) {
+        fprintf(stderr, "Warning: couldn't write the snapshot \"%s\".\n", snapshot_name);
+        unlink(temp_snapshot_name);
+    } else {
+        printf("Wrote snapshot \"%s\".\n", snapshot_name);
+    }
+    free(writer.data);
+}
+
+// Checks that everything in the sections of a snapshot points to where it may; the section sizes have to be checked already.
+// The crc32 only protects against damaged files, a snapshot that was made up or written by a broken build could still be
+// anything, and it's mapped and used right away.
+static _Bool check_snapshot_contents(const Byte *map, const snapshot_header *header)
+{
+    const uint64_t *sections = header->section_offsets;
+    const uint64_t *sizes = header->section_sizes;
+    const Byte *raw_psb = &map[sections[SECTION_RAW_PSB]];
+    uint32_t raw_psb_size = header->raw_psb_size;
+    if (header->raw_names_offset > raw_psb_size || header->raw_names_size > raw_psb_size - header->raw_names_offset
+        || header->raw_strings_offset > raw_psb_size || header->raw_strings_size > raw_psb_size - header->raw_strings_offset) {
+        return 0;
+    }
+
+    // every name and string has to end inside of its section
+    const uint32_t *offsets = (const uint32_t *) &map[sections[SECTION_NAME_OFFSETS]];
+    const Byte *names = &map[sections[SECTION_NAMES]];
+    if (header->names_amount && (sizes[SECTION_NAMES] == 0 || names[sizes[SECTION_NAMES] - 1] != '\0')) {
+        return 0;
+    }
+    for (uint32_t i = 0; i < header->names_amount; i++) {
+        if (offsets[i] >= sizes[SECTION_NAMES]) {
+            return 0;
+        }
+    }
+    offsets = (const uint32_t *) &map[sections[SECTION_STRING_OFFSETS]];
+    for (uint32_t i = 0; i < header->strings_amount; i++) {
+        if (offsets[i] >= raw_psb_size || memchr(&raw_psb[offsets[i]], '\0', raw_psb_size - offsets[i]) == NULL) {
+            return 0;
+        }
+    }
+    offsets = (const uint32_t *) &map[sections[SECTION_CHUNK_OFFSETS]];
+    for (uint32_t i = 0; i < header->chunkdata_size; i++) {
+        if (offsets[i] > raw_psb_size) {
+            return 0;
+        }
+    }
+
+    // the nodes that were read have to link to nodes that exist, and their raw data has to be inside of the raw psb
+    uint32_t node_amount = header->node_amount;
+    const uint8_t *types = &map[sections[SECTION_NODE_TYPES]];
+    const uint32_t *lengths = (const uint32_t *) &map[sections[SECTION_NODE_LENGTHS]];
+    const uint32_t *first_children = (const uint32_t *) &map[sections[SECTION_NODE_FIRST_CHILDREN]];
+    const uint32_t *name_indexes = (const uint32_t *) &map[sections[SECTION_NODE_NAME_INDEXES]];
+    const uint32_t *parents = (const uint32_t *) &map[sections[SECTION_NODE_PARENTS]];
+    const uint32_t *raw_offsets = (const uint32_t *) &map[sections[SECTION_NODE_RAW_OFFSETS]];
+    const uint32_t *raw_sizes = (const uint32_t *) &map[sections[SECTION_NODE_RAW_SIZES]];
+    for (uint32_t i = 0; i < node_amount; i++) {
+        if (types[i] > 33 || raw_offsets[i] >= raw_psb_size || raw_sizes[i] > raw_psb_size - raw_offsets[i]
+            || (parents[i] != NO_NODE && parents[i] >= node_amount) || (i == 0) != (parents[i] == NO_NODE)
+            || (parents[i] != NO_NODE && types[parents[i]] == 33 && name_indexes[i] >= header->names_amount)) {
+            return 0;
+        }
+        if (types[i] >= 32 && first_children[i] != NO_NODE && (first_children[i] > node_amount || lengths[i] > node_amount - first_children[i])) {
+            return 0;
+        }
+    }
+
+    const file_info *file_infos = (const file_info *) &map[sections[SECTION_FILE_INFO]];
+    for (uint32_t i = 0; i < header->file_info_amount; i++) {
+        if (file_infos[i].name_index >= header->names_amount || file_infos[i].offset_node >= node_amount || file_infos[i].length_node >= node_amount
+            || types[file_infos[i].offset_node] < 4 || types[file_infos[i].offset_node] > 12
+            || types[file_infos[i].length_node] < 4 || types[file_infos[i].length_node] > 12) {
+            return 0;
+        }
+    }
+    // find_file_info needs an empty slot to stop at
+    uint32_t capacity = header->file_info_slots_capacity;
+    if (capacity == 0 || (capacity & (capacity - 1)) != 0 || capacity <= header->file_info_amount) {
+        return 0;
+    }
+    const uint32_t *slots = (const uint32_t *) &map[sections[SECTION_FILE_INFO_SLOTS]];
+    for (uint32_t i = 0; i < capacity; i++) {
+        if (slots[i] > header->file_info_amount) {
+            return 0;
+        }
+    }
+    const uint32_t *by_name = (const uint32_t *) &map[sections[SECTION_FILE_INFO_BY_NAME]];
+    for (uint32_t i = 0; i < header->file_info_amount; i++) {
+        if (by_name[i] >= header->file_info_amount) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Loads the psb from its snapshot; returns NULL if there is none or it doesn't belong to the psb.m (anymore)
+psb_data *load_snapshot(const char *psb_filename)
+{
+    int name_length = strlen(psb_filename);
+    char snapshot_name[name_length + 10];
+    sprintf(snapshot_name, "%s.snapshot", psb_filename);
+    int snapshot_file = open(snapshot_name, O_RDONLY);
+    if (snapshot_file == -1) {
+        return NULL;
+    }
+    struct stat snapshot_stat;
+    fstat(snapshot_file, &snapshot_stat);
+    uint64_t header_size = (sizeof(snapshot_header) + 7) / 8 * 8;
+    if (snapshot_stat.st_size < header_size) {
+        close(snapshot_file);
+        return NULL;
+    }
+    Byte *map = mmap(NULL, snapshot_stat.st_size, PROT_READ, MAP_PRIVATE, snapshot_file, 0);
+    close(snapshot_file);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+
+    // the cheap checks go first, the crc32s need to read both files completely
+    const snapshot_header *header = (const snapshot_header *) map;
+    psb_source source;
+    _Bool valid = memcmp(header->magic, SNAPSHOT_MAGIC, 8) == 0 && header->version == SNAPSHOT_VERSION && get_psb_source(psb_filename, &source)
+        && source.size == header->source.size && source.mtime_sec == header->source.mtime_sec && source.mtime_nsec == header->source.mtime_nsec
+        && source.crc == header->source.crc;
+    uint64_t expected_sizes[SECTION_AMOUNT] = {
+        [SECTION_RAW_PSB] = header->raw_psb_size,
+        [SECTION_NAME_OFFSETS] = header->names_amount * sizeof(uint32_t),
+        [SECTION_STRING_OFFSETS] = header->strings_amount * sizeof(uint32_t),
+        [SECTION_CHUNK_OFFSETS] = header->chunkdata_size * sizeof(uint32_t),
+        [SECTION_NODE_TYPES] = header->node_amount * sizeof(uint8_t),
+        [SECTION_NODE_VALUES] = header->node_amount * sizeof(uint64_t),
+        [SECTION_NODE_LENGTHS] = header->node_amount * sizeof(uint32_t),
+        [SECTION_NODE_FIRST_CHILDREN] = header->node_amount * sizeof(uint32_t),
+        [SECTION_NODE_NAME_INDEXES] = header->node_amount * sizeof(uint32_t),
+        [SECTION_NODE_PARENTS] = header->node_amount * sizeof(uint32_t),
+        [SECTION_NODE_RAW_OFFSETS] = header->node_amount * sizeof(uint32_t),
+        [SECTION_NODE_RAW_SIZES] = header->node_amount * sizeof(uint32_t),
+        [SECTION_FILE_INFO] = header->file_info_amount * sizeof(file_info),
+        [SECTION_FILE_INFO_SLOTS] = header->file_info_slots_capacity * sizeof(uint32_t),
+        [SECTION_FILE_INFO_BY_NAME] = header->file_info_amount * sizeof(uint32_t),
+        [SECTION_XOR_KEYS] = header->file_info_amount * 80ull,
+    };
+    for (int i = 0; valid && i < SECTION_AMOUNT; i++) {
+        valid = header->section_offsets[i] >= header_size && header->section_offsets[i] % 8 == 0
+            && header->section_sizes[i] <= (uint64_t) snapshot_stat.st_size && header->section_offsets[i] <= snapshot_stat.st_size - header->section_sizes[i]
+            && (i == SECTION_NAMES || header->section_sizes[i] == expected_sizes[i]);
+    }
+    valid = valid && header->node_amount > 0 && crc32(0, &map[header_size], snapshot_stat.st_size - header_size) == header->checksum
+        && check_snapshot_contents(map, header);
+    if (!valid) {
+        printf("Snapshot \"%s\" is outdated, loading the psb.m instead.\n", snapshot_name);
+        munmap(map, snapshot_stat.st_size);
+        return NULL;
+    }
+    printf("Loading snapshot \"%s\".\n", snapshot_name);
+
+    arena *my_arena = arena_create();
+    psb_data *my_psb_data = arena_calloc(my_arena, 1, sizeof(psb_data));
+    my_psb_data->arena = my_arena;
+    my_psb_data->snapshot_map = map;
+    my_psb_data->snapshot_map_size = snapshot_stat.st_size;
+    my_psb_data->source = header->source;
+    my_psb_data->header = arena_alloc(my_arena, sizeof(psb_header));
+    *my_psb_data->header = header->header;
+    const uint64_t *sections = header->section_offsets;
+    Byte *raw_psb = &map[sections[SECTION_RAW_PSB]];
+
+    my_psb_data->names_amount = header->names_amount;
+    my_psb_data->names = arena_alloc(my_arena, header->names_amount * sizeof(char *));
+    const uint32_t *offsets = (const uint32_t *) &map[sections[SECTION_NAME_OFFSETS]];
+    for (uint32_t i = 0; i < header->names_amount; i++) {
+        my_psb_data->names[i] = (char *) &map[sections[SECTION_NAMES] + offsets[i]];
+    }
+    my_psb_data->strings_amount = header->strings_amount;
+    my_psb_data->strings = arena_alloc(my_arena, header->strings_amount * sizeof(char *));
+    offsets = (const uint32_t *) &map[sections[SECTION_STRING_OFFSETS]];
+    for (uint32_t i = 0; i < header->strings_amount; i++) {
+        my_psb_data->strings[i] = (char *) &raw_psb[offsets[i]];
+    }
+    my_psb_data->chunkdata_size = header->chunkdata_size;
+    my_psb_data->chunkdata = arena_alloc(my_arena, header->chunkdata_size * sizeof(Byte *));
+    offsets = (const uint32_t *) &map[sections[SECTION_CHUNK_OFFSETS]];
+    for (uint32_t i = 0; i < header->chunkdata_size; i++) {
+        my_psb_data->chunkdata[i] = &raw_psb[offsets[i]];
+    }
+
+    original_psb_data *my_original_psb_data = arena_alloc(my_arena, sizeof(original_psb_data));
+    my_original_psb_data->raw_psb = raw_psb;
+    my_original_psb_data->raw_psb_size = header->raw_psb_size;
+    my_original_psb_data->raw_names = &raw_psb[header->raw_names_offset];
+    my_original_psb_data->raw_names_size = header->raw_names_size;
+    my_original_psb_data->raw_strings = &raw_psb[header->raw_strings_offset];
+    my_original_psb_data->raw_strings_size = header->raw_strings_size;
+    my_psb_data->raw_psb_data = my_original_psb_data;
+
+    // the node table can still grow when more nodes are visited, so it's copied out
+    psb_nodes *nodes = &my_psb_data->entries;
+    memset(nodes, 0, sizeof(psb_nodes));
+    add_psb_nodes(nodes, header->node_amount);
+    memcpy(nodes->types, &map[sections[SECTION_NODE_TYPES]], header->node_amount * sizeof(uint8_t));
+    memcpy(nodes->values, &map[sections[SECTION_NODE_VALUES]], header->node_amount * sizeof(uint64_t));
+    memcpy(nodes->lengths, &map[sections[SECTION_NODE_LENGTHS]], header->node_amount * sizeof(uint32_t));
+    memcpy(nodes->first_children, &map[sections[SECTION_NODE_FIRST_CHILDREN]], header->node_amount * sizeof(uint32_t));
+    memcpy(nodes->name_indexes, &map[sections[SECTION_NODE_NAME_INDEXES]], header->node_amount * sizeof(uint32_t));
+    memcpy(nodes->parents, &map[sections[SECTION_NODE_PARENTS]], header->node_amount * sizeof(uint32_t));
+    memcpy(nodes->raw_sizes, &map[sections[SECTION_NODE_RAW_SIZES]], header->node_amount * sizeof(uint32_t));
+    offsets = (const uint32_t *) &map[sections[SECTION_NODE_RAW_OFFSETS]];
+    for (uint32_t i = 0; i < header->node_amount; i++) {
+        nodes->raw_data[i] = &raw_psb[offsets[i]];
+    }
+
+    my_psb_data->file_info_amount = header->file_info_amount;
+    my_psb_data->file_info = arena_alloc(my_arena, header->file_info_amount * sizeof(file_info));
+    memcpy(my_psb_data->file_info, &map[sections[SECTION_FILE_INFO]], header->file_info_amount * sizeof(file_info));
+    my_psb_data->file_info_slots_capacity = header->file_info_slots_capacity;
+    my_psb_data->file_info_slots = arena_alloc(my_arena, header->file_info_slots_capacity * sizeof(uint32_t));
+    memcpy(my_psb_data->file_info_slots, &map[sections[SECTION_FILE_INFO_SLOTS]], header->file_info_slots_capacity * sizeof(uint32_t));
+    my_psb_data->file_info_by_name = arena_alloc(my_arena, header->file_info_amount * sizeof(uint32_t));
+    memcpy(my_psb_data->file_info_by_name, &map[sections[SECTION_FILE_INFO_BY_NAME]], header->file_info_amount * sizeof(uint32_t));
+
+    const Byte *xor_keys = &map[sections[SECTION_XOR_KEYS]];
+    for (uint32_t i = 0; i < header->file_info_amount; i++) {
+        add_xor_key(my_psb_data->names[my_psb_data->file_info[i].name_index], &xor_keys[i * 80]);
+    }
+    return my_psb_data;
+}
+
+// whether there is an array of ints at pointer that ends before end, so that read_int_array can read it
+static _Bool is_int_array(const Byte *pointer, const Byte *end)
+{
+    if (pointer >= end || *pointer < 13 || *pointer > 20) {
+        return 0;
+    }
+    int count_size = *pointer - 12;
+    if (end - pointer < 2 + count_size || pointer[1 + count_size] < 13 || pointer[1 + count_size] > 20) {
+        return 0;
+    }
+    uint64_t count = 0;
+    memcpy(&count, &pointer[1], count_size);
+    return count <= UINT32_MAX && (uint64_t) (end - pointer - 2 - count_size) >= count * (pointer[1 + count_size] - 12);
+}
+
+// Decrypts, uncompresses and decodes the psb.m; returns NULL (with the reason printed) if it can't be read or is broken
+psb_data *parse_psb_file(const char *psb_filename)
+{
+    int in_psb_file = open(psb_filename, O_RDONLY);
+    if (in_psb_file == -1) {
+        fprintf(stderr, "Error: file \"%s\" can't be accessed. Make sure it exists and is accessable.\n", psb_filename);
+        return NULL;
+    }
+
+    struct stat psb_stat;
+    fstat(in_psb_file, &psb_stat);
+    printf("original (compressed) psb size: %lld\n", (long long) psb_stat.st_size);
+
+    // the file is decrypted and uncompressed in chunks while it's being read
+    mdf_reader *reader = malloc(sizeof(mdf_reader));
+    if (!mdf_open(reader, in_psb_file, 0, psb_stat.st_size, psb_filename)) {
+        fprintf(stderr, "Error: Input file does not have the correct signature.\n");
+        free(reader);
+        close(in_psb_file);
+        return NULL;
+    } else {
+        printf("Signature correct.\n");
+    }
+
+    // everything loaded from here on goes into the arena of the psb_data
+    arena *my_arena = arena_create();
+    psb_data *my_psb_data = arena_calloc(my_arena, 1, sizeof(psb_data));
+    my_psb_data->arena = my_arena;
+    my_psb_data->bin_file = -1; // so free_psb_data can clean up after a broken psb
+    my_psb_data->source.size = psb_stat.st_size;
+    my_psb_data->source.mtime_sec = psb_stat.st_mtim.tv_sec;
+    my_psb_data->source.mtime_nsec = psb_stat.st_mtim.tv_nsec;
+    uLong uncompressed_size = reader->uncompressed_size;
+    Byte *raw_psb_data = arena_alloc(my_arena, uncompressed_size);
+    _Bool complete = mdf_read(reader, raw_psb_data, uncompressed_size) == uncompressed_size;
+    mdf_close(reader);
+    free(reader);
+    close(in_psb_file);
+    if (!complete || uncompressed_size < 40) {
+        if (!complete) {
+            fprintf(stderr, "MAJOR error was occuring here; the psb is shorter than its header says.\n");
+        } else {
+            fprintf(stderr, "Error: the psb is too short for its header.\n");
+        }
+        free_psb_data(my_psb_data);
+        return NULL;
+    }
+    printf("original uncompressed psb size: %ld\n", uncompressed_size);
+
+    if (debug_filewrites) {
+        FILE *out_file = fopen("__original_uncompressed_psb_data.psb", "wb");
+        if (out_file == NULL) {
+            fprintf(stderr, "Error when opening uncompressed psb output file.\n");
+        } else {
+            fwrite(raw_psb_data, uncompressed_size, 1, out_file);
+            fclose(out_file);
+        }
+    }
+
+    // read in the psb header into our psb_header struct
+    psb_header *my_psb_header = arena_alloc(my_arena, sizeof(psb_header));
+    memcpy(&my_psb_header->signature, raw_psb_data, 4);
+    memcpy(&my_psb_header->type, &raw_psb_data[4], 4);
+    memcpy(&my_psb_header->unknown1, &raw_psb_data[8], 4);
+    memcpy(&my_psb_header->offset_names, &raw_psb_data[12], 4);
+    memcpy(&my_psb_header->offset_strings, &raw_psb_data[16], 4);
+    memcpy(&my_psb_header->offset_strings_data, &raw_psb_data[20], 4);
+    memcpy(&my_psb_header->offset_chunk_offsets, &raw_psb_data[24], 4);
+    memcpy(&my_psb_header->offset_chunk_lengths, &raw_psb_data[28], 4);
+    memcpy(&my_psb_header->offset_chunk_data, &raw_psb_data[32], 4);
+    memcpy(&my_psb_header->offset_entries, &raw_psb_data[36], 4);
+
+    // everything below reads the arrays at these offsets without looking, so they have to be there
+    const Byte *raw_psb_end = &raw_psb_data[uncompressed_size];
+    const Byte *names_position = &raw_psb_data[my_psb_header->offset_names < uncompressed_size ? my_psb_header->offset_names : uncompressed_size];
+    _Bool arrays_valid = is_int_array(names_position, raw_psb_end);
+    for (int i = 0; i < 2 && arrays_valid; i++) {
+        int_array_view skipped;
+        names_position = read_int_array(names_position, &skipped);
+        arrays_valid = is_int_array(names_position, raw_psb_end);
+    }
+    uint32_t array_offsets[] = {my_psb_header->offset_strings, my_psb_header->offset_chunk_offsets, my_psb_header->offset_chunk_lengths};
+    for (int i = 0; i < 3 && arrays_valid; i++) {
+        arrays_valid = array_offsets[i] < uncompressed_size && is_int_array(&raw_psb_data[array_offsets[i]], raw_psb_end);
+    }
+    if (!arrays_valid || my_psb_header->offset_strings_data > uncompressed_size || my_psb_header->offset_entries >= uncompressed_size) {
+        fprintf(stderr, "Error: the psb header points outside of the psb.\n");
+        free_psb_data(my_psb_data);
+        return NULL;
+    }
+
+    // read in all psb data into our psb_data struct
+    my_psb_data->header = my_psb_header;
+    original_psb_data *my_original_psb_data = arena_alloc(my_arena, sizeof(original_psb_data));
+    const Byte *current_position = &raw_psb_data[my_psb_header->offset_names];
+
+
+    // unpack_names function
+    int_array_view offsets;
+    int_array_view jumps;
+    int_array_view starts;
+    current_position = read_int_array(current_position, &offsets);
+    current_position = read_int_array(current_position, &jumps);
+    current_position = read_int_array(current_position, &starts);
+
+    // the arrays of the trie are walked over and over, so they get decoded once up front
+    uint32_t *offset_entries = arena_alloc(my_arena, offsets.count * sizeof(uint32_t));
+    uint32_t *jump_entries = arena_alloc(my_arena, jumps.count * sizeof(uint32_t));
+    uint32_t *start_entries = arena_alloc(my_arena, starts.count * sizeof(uint32_t));
+    decode_int_array(&offsets, offset_entries);
+    decode_int_array(&jumps, jump_entries);
+    decode_int_array(&starts, start_entries);
+
+    my_psb_data->names = arena_alloc(my_arena, starts.count * sizeof(char *));
+    my_psb_data->names_amount = starts.count;
+
+    // The names are stored as a trie: starting at the last character of a name, jumps leads to the node of the character
+    // before it, up to the root node 0, and the character is the difference between the node and offsets of the next one.
+    // Every node stands for the beginning of all names below it, so once a name is decoded, the nodes on its way are
+    // remembered as (that name, length of the beginning). Every following name only walks up to the first known node,
+    // which means every node of the trie is walked only once.
+    if (debug) {
+        printf("Started deciphering the file names...\n");
+    }
+    _Bool names_valid = 1;
+    const char **node_names = calloc(jumps.count ? jumps.count : 1, sizeof(char *));
+    uint32_t *node_depths = calloc(jumps.count ? jumps.count : 1, sizeof(uint32_t));
+    node_names[0] = "";
+    uint32_t path_capacity = 256;
+    uint32_t *path = malloc(path_capacity * sizeof(uint32_t)); // the nodes that are walked, starting with the last character
+
+    for (int i = 0; i < starts.count && names_valid; i++) {
+        uint32_t a = start_entries[i];
+
+        uint32_t path_length = 0;
+        while (a >= jumps.count || !node_names[a]) {
+            if (a >= jumps.count || jump_entries[a] >= offsets.count || path_length == jumps.count) {
+                names_valid = 0;
+                break;
+            }
+            if (path_length == path_capacity) {
+                path_capacity *= 2;
+                path = realloc(path, path_capacity * sizeof(uint32_t));
+            }
+            path[path_length++] = a;
+            a = jump_entries[a];
+        }
+
+        if (names_valid && path_length) {
+            uint32_t known_depth = node_depths[a];
+            char *name = arena_alloc(my_arena, known_depth + path_length);
+            memcpy(name, node_names[a], known_depth);
+            for (uint32_t k = path_length; k-- > 0;) {
+                uint32_t node = path[k];
+                int d = node - offset_entries[jump_entries[node]];
+                if (d < 0) {
+                    names_valid = 0;
+                    break;
+                }
+                uint32_t depth = known_depth + path_length - k;
+                name[depth - 1] = d;
+                node_names[node] = name;
+                node_depths[node] = depth;
+            }
+        }
+
+        if (!names_valid) {
+            break;
+        }
+        my_psb_data->names[i] = (char *) node_names[start_entries[i]];
+        if (debug) {
+            printf("%03d: %s\n", i, my_psb_data->names[i]);
+        }
+    }
+    free(node_names);
+    free(node_depths);
+    free(path);
+    if (!names_valid) {
+        fprintf(stderr, "Error: the names in the psb are broken.\n");
+        free_psb_data(my_psb_data);
+        return NULL;
+    }
+    // save the raw byte-data as raw_names for easier access when packing later
+    my_original_psb_data->raw_names_size = current_position - &raw_psb_data[my_psb_data->header->offset_names];
+    my_original_psb_data->raw_names = &raw_psb_data[my_psb_data->header->offset_names];
+
+
+    // unpack_strings function
+    if (debug) {
+        printf("Started unpacking strings...\n");
+    }
+    int_array_view string_offsets;
+    read_int_array(&raw_psb_data[my_psb_data->header->offset_strings], &string_offsets);
+    my_psb_data->strings = arena_alloc(my_arena, string_offsets.count * sizeof(char *));
+    my_psb_data->strings_amount = string_offsets.count;
+    uint32_t *string_offset_entries = arena_alloc(my_arena, string_offsets.count * sizeof(uint32_t));
+    decode_int_array(&string_offsets, string_offset_entries);
+
+    // the strings array just points into the raw data, which is kept around anyway
+    const Byte *strings_data = &raw_psb_data[my_psb_data->header->offset_strings_data];
+    uint32_t last_string_offset = 0;
+    for (int i = 0; i < string_offsets.count; i++) {
+        if (string_offset_entries[i] > last_string_offset) {
+            last_string_offset = string_offset_entries[i];
+        }
+    }
+    uint32_t strings_data_size = string_offsets.count ? last_string_offset + strlen((char *) &strings_data[last_string_offset]) + 1 : 0;
+
+    for (int i = 0; i < string_offsets.count; i++) {
+        my_psb_data->strings[i] = (char *) &strings_data[string_offset_entries[i]];
+        if (debug) {
+            printf("string at offset %d: \"%s\"\n", i,  my_psb_data->strings[i]);
+        }
+    }
+    // save the raw byte-data as raw_strings for easier access when packing later
+    my_original_psb_data->raw_strings_size = &strings_data[strings_data_size] - &raw_psb_data[my_psb_data->header->offset_strings];
+    my_original_psb_data->raw_strings = &raw_psb_data[my_psb_data->header->offset_strings];
+
+
+    // unpack_chunks function
+    int_array_view chunk_offsets;
+    int_array_view chunk_lengths;
+    read_int_array(&raw_psb_data[my_psb_header->offset_chunk_offsets], &chunk_offsets);
+    read_int_array(&raw_psb_data[my_psb_header->offset_chunk_lengths], &chunk_lengths);
+    my_psb_data->chunkdata_size = chunk_offsets.count;
+    my_psb_data->chunkdata = arena_alloc(my_arena, chunk_offsets.count * sizeof(Byte *));
+    uint32_t *chunk_offset_entries = arena_alloc(my_arena, chunk_offsets.count * sizeof(uint32_t));
+    decode_int_array(&chunk_offsets, chunk_offset_entries);
+    for (int i = 0; i < chunk_offsets.count; i++) {
+        my_psb_data->chunkdata[i] = &raw_psb_data[my_psb_header->offset_chunk_data + chunk_offset_entries[i]];
+    }
+
+
+    // unpack_entries function
+    // takes around 0.1 seconds
+    open_psb_entries(my_psb_data, &raw_psb_data[my_psb_header->offset_entries]);
+    if (!read_file_info(my_psb_data)) {
+        free_psb_data(my_psb_data);
+        return NULL;
+    }
+    index_file_info(my_psb_data);
+
+    // the raw data is kept around, unmodified parts of it get copied when packing
+    my_original_psb_data->raw_psb = raw_psb_data;
+    my_original_psb_data->raw_psb_size = uncompressed_size;
+    my_psb_data->raw_psb_data = my_original_psb_data;
+    return my_psb_data;
+}
+
+// Maps the .bin file that belongs to the psb.m and sets up the views of the subfiles in it; returns 0 if that isn't possible
+_Bool map_bin_file(psb_data *my_psb_data, const char *psb_filename)
+{
+    arena *my_arena = my_psb_data->arena;
+
+    // start mapping in the bin file
+    int psb_filename_length = strlen(psb_filename);
+    char bin_name[psb_filename_length - 1];
+    memcpy(bin_name, psb_filename, psb_filename_length - 6);
+    strcpy(&bin_name[psb_filename_length - 6], ".bin");
+    printf("Mapping bin file \"%s\".\n", bin_name);
+
+    int bin_file = open(bin_name, O_RDONLY);
+    if (bin_file == -1) {
+        fprintf(stderr, "corresponding \".bin\" file doesn't exist.\n");
+        my_psb_data->bin_file = -1;
+        return 0;
+    }
+
+    // map the bin file instead of reading it in; the kernel only loads the parts that actually get used
+    struct stat bin_stat;
+    fstat(bin_file, &bin_stat);
+    my_psb_data->bin_map_size = bin_stat.st_size;
+    my_psb_data->bin_map = NULL;
+    my_psb_data->bin_file = bin_file; // kept open for pack_bin
+    if (my_psb_data->bin_map_size) {
+        my_psb_data->bin_map = mmap(NULL, my_psb_data->bin_map_size, PROT_READ, MAP_PRIVATE, bin_file, 0);
+        if (my_psb_data->bin_map == MAP_FAILED) {
+            fprintf(stderr, "Error: couldn't map the bin file into memory.\n");
+            my_psb_data->bin_map = NULL;
+            return 0;
+        }
+    }
+
+    // the psb_data->subfile_data are just views into the mapped bin file
+    my_psb_data->subfile_data = arena_alloc(my_arena, my_psb_data->file_info_amount * sizeof(Byte *));
+    for (int i = 0; i < my_psb_data->file_info_amount; i++) {
+        if (get_file_info_offset(my_psb_data, i) + get_file_info_length(my_psb_data, i) > my_psb_data->bin_map_size) {
+            fprintf(stderr, "Error: subfile %d lies outside of the bin file.\n", i);
+            return 0;
+        }
+        my_psb_data->subfile_data[i] = &my_psb_data->bin_map[get_file_info_offset(my_psb_data, i)];
+    }
+    return 1;
+}
+
+// Loads the psb.m and maps its bin; returns NULL (with the reason printed) if either of them can't be read or is broken
+psb_data *try_load_from_psb(const char *psb_filename)
+{
+    // a snapshot brings the xor keys along
+    psb_data *my_psb_data = use_snapshots ? load_snapshot(psb_filename) : NULL;
+    if (my_psb_data == NULL) {
+        my_psb_data = parse_psb_file(psb_filename);
+        if (my_psb_data == NULL) {
+            return NULL;
+        }
+        precompute_xor_keys(my_psb_data);
+        if (use_snapshots) {
+            write_snapshot(my_psb_data, psb_filename);
+        }
+    }
+
+    // Debug file_info output
+    if (debug) {
+        printf("file info before rom injection:\n");
+        for (int i = 0; i < my_psb_data->file_info_amount; i++) {
+            printf("file_info[%03d]: (name_index = %3u, offset = %8"PRIu64", length = %7"PRIu64"); string = \"%s\"\n", i, my_psb_data->file_info[i].name_index, get_file_info_offset(my_psb_data, i), get_file_info_length(my_psb_data, i), my_psb_data->names[my_psb_data->file_info[i].name_index]);
+        }
+    }
+
+    if (!map_bin_file(my_psb_data, psb_filename)) {
+        free_psb_data(my_psb_data);
+        return NULL;
+    }
+    return my_psb_data;
+}
+
+psb_data *load_from_psb(const char *psb_filename)
+{
+    psb_data *my_psb_data = try_load_from_psb(psb_filename);
+    if (my_psb_data == NULL) {
+        fprintf(stderr, "Error: \"%s\" couldn't be loaded. Will now terminate.\n", psb_filename);
+        exit(EXIT_FAILURE);
+    }
+    return my_psb_data;
+}
+
+
+int get_thread_count(void)
+{
+    if (local_thread_count > 0) {
+        return local_thread_count;
+    }
+    if (thread_count > 0) {
+        return thread_count;
+    }
+    long online_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return online_cpus > 0 ? online_cpus : 1;
+}
+
+
+// run_parallel hands its work to a pool of threads that is started once and then reused, so calling it often (e.g. for every
+// big node when walking the entries) doesn't create and join threads every time. Every call is a job with a shared counter
+// that all threads working on it keep pulling the next unprocessed index from. The calling thread always works on its own job
+// as well and only waits for the pool threads that actually joined it, so nested and concurrent calls can't wait on each
+// other; the pool grows when more helpers are wanted than there are idle threads.
+struct _parallel_job {
+    void (*function)(void *context, int index);
+    void *context;
+    int count;
+    int next_index;
+    int wanted_helpers; // pool threads that may still join, the job is queued as long as this isn't 0
+    int active_helpers; // pool threads that are working on it right now
+    struct _parallel_job *next;
+};
+
+struct _thread_pool {
+    pthread_mutex_t lock; // guards everything below and the helper counts of the jobs
+    pthread_cond_t work_available;
+    pthread_cond_t helper_finished;
+    struct _parallel_job *jobs; // the jobs that want more helpers, oldest first
+    int idle_threads;
+};
+
+struct _thread_pool thread_pool = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, 0};
+pthread_once_t thread_pool_fork_handlers = PTHREAD_ONCE_INIT;
+
+static void work_on_parallel_job(struct _parallel_job *job)
+{
+    int index;
+    while ((index = __atomic_fetch_add(&job->next_index, 1, __ATOMIC_RELAXED)) < job->count) {
+        job->function(job->context, index);
+    }
+}
+
+static void *thread_pool_worker(void *argument)
+{
+    (void) argument;
+    pthread_mutex_lock(&thread_pool.lock);
+    while (1) {
+        while (thread_pool.jobs == NULL) {
+            pthread_cond_wait(&thread_pool.work_available, &thread_pool.lock);
+        }
+        struct _parallel_job *job = thread_pool.jobs;
+        job->active_helpers++;
+        if (--job->wanted_helpers == 0) {
+            thread_pool.jobs = job->next;
+        }
+        thread_pool.idle_threads--;
+        pthread_mutex_unlock(&thread_pool.lock);
+
+        work_on_parallel_job(job);
+
+        pthread_mutex_lock(&thread_pool.lock);
+        thread_pool.idle_threads++;
+        if (--job->active_helpers == 0) {
+            pthread_cond_broadcast(&thread_pool.helper_finished);
+        }
+    }
+    return NULL;
+}
+
+// only the forking thread exists in a child, so it starts over with an empty pool
+static void lock_thread_pool(void)
+{
+    pthread_mutex_lock(&thread_pool.lock);
+}
+
+static void unlock_thread_pool(void)
+{
+    pthread_mutex_unlock(&thread_pool.lock);
+}
+
+static void reset_thread_pool(void)
+{
+    // the condition variables still count the waiting threads of the parent, which would block them forever
+    pthread_cond_init(&thread_pool.work_available, NULL);
+    pthread_cond_init(&thread_pool.helper_finished, NULL);
+    thread_pool.jobs = NULL;
+    thread_pool.idle_threads = 0;
+    pthread_mutex_unlock(&thread_pool.lock);
+}
+
+static void register_thread_pool_fork_handlers(void)
+{
+    pthread_atfork(lock_thread_pool, unlock_thread_pool, reset_thread_pool);
+}
+
+// Calls function(context, i) for every i in [0, count), spread over up to get_thread_count() threads.
+// The calling thread works as well, so a thread count of 1 doesn't involve the pool at all.
+void run_parallel(void (*function)(void *context, int index), void *context, int count)
+{
+    struct _parallel_job job = {function, context, count, 0, get_thread_count() - 1, 0, NULL};
+    if (job.wanted_helpers > count - 1) {
+        job.wanted_helpers = count - 1;
+    }
+    if (job.wanted_helpers <= 0) {
+        work_on_parallel_job(&job);
+        return;
+    }
+    pthread_once(&thread_pool_fork_handlers, register_thread_pool_fork_handlers);
+
+    pthread_mutex_lock(&thread_pool.lock);
+    struct _parallel_job **last = &thread_pool.jobs;
+    int wanted_helpers = job.wanted_helpers;
+    while (*last) {
+        wanted_helpers += (*last)->wanted_helpers;
+        last = &(*last)->next;
+    }
+    *last = &job;
+    for (; thread_pool.idle_threads < wanted_helpers; thread_pool.idle_threads++) {
+        pthread_t worker;
+        if (pthread_create(&worker, NULL, thread_pool_worker, NULL) != 0) {
+            break; // the threads that are there do the work, or this one does it alone
+        }
+        pthread_detach(worker);
+    }
+    pthread_cond_broadcast(&thread_pool.work_available);
+    pthread_mutex_unlock(&thread_pool.lock);
+
+    work_on_parallel_job(&job);
+
+    // no more helpers may join once all indexes are taken, then the ones that did have to finish their last one
+    pthread_mutex_lock(&thread_pool.lock);
+    if (job.wanted_helpers) {
+        for (struct _parallel_job **queued = &thread_pool.jobs; *queued; queued = &(*queued)->next) {
+            if (*queued == &job) {
+                *queued = job.next;
+                break;
+            }
+        }
+        job.wanted_helpers = 0;
+    }
+    while (job.active_helpers) {
+        pthread_cond_wait(&thread_pool.helper_finished, &thread_pool.lock);
+    }
+    pthread_mutex_unlock(&thread_pool.lock);
+}
+
+
+// rom data is compressed in independent blocks like pigz does it; every block gets the 32k of input before it as a dictionary,
+// so the result is (nearly) as good as a single compress2 call, but the blocks can be compressed at the same time
+#define DEFLATE_BLOCK_SIZE (128 * 1024)
+#define DEFLATE_WINDOW_SIZE (32 * 1024)
+
+struct _deflate_block {
+    const Byte *input;
+    uInt input_size;
+    uInt dictionary_size; // amount of bytes directly in front of input to use as dictionary
+    _Bool last;
+    Byte *output;
+    uLong output_capacity;
+    uLong output_size;
+    uLong adler;
+    _Bool failed;
+};
+
+typedef struct _deflate_block deflate_block;
+
+static void deflate_block_worker(void *context, int index)
+{
+    deflate_block *block = &((deflate_block *) context)[index];
+
+    z_stream stream = {0};
+    int return_value = deflateInit2(&stream, 9, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY); // raw deflate, we write the zlib wrapper ourselves
+    if (return_value != Z_OK) {
+        fprintf(stderr, "Error when initializing rom block compression. The return code was %d.\n", return_value);
+        block->failed = 1;
+        return;
+    }
+    if (block->dictionary_size) {
+        deflateSetDictionary(&stream, block->input - block->dictionary_size, block->dictionary_size);
+    }
+
+    // non-last blocks are ended with a sync flush, which byte-aligns them so they can simply be concatenated
+    stream.next_in = (Byte *) block->input;
+    stream.avail_in = block->input_size;
+    stream.next_out = block->output;
+    stream.avail_out = block->output_capacity;
+    return_value = deflate(&stream, block->last ? Z_FINISH : Z_SYNC_FLUSH);
+    if (return_value != (block->last ? Z_STREAM_END : Z_OK) || stream.avail_in != 0) {
+        fprintf(stderr, "Error when compressing rom block %d. The return code was %d.\n", index, return_value);
+        deflateEnd(&stream);
+        block->failed = 1;
+        return;
+    }
+    block->output_size = block->output_capacity - stream.avail_out;
+    deflateEnd(&stream);
+
+    block->adler = adler32(adler32(0L, Z_NULL, 0), block->input, block->input_size);
+}
+
+// writes data_length bytes to out_file at *position and xors them first (in place), as if they were part of one long xor'd stream
+// that starts at stream_start; a NULL xor_key only writes them
+static _Bool write_xored(int out_file, Byte *data, uLong data_length, const Byte *xor_key, uint64_t *position, uint64_t stream_start)
+{
+    if (xor_key) {
+        xor_data_with_key(data, xor_key, data_length, *position - stream_start);
+    }
+    if (!write_all(out_file, data, data_length, *position)) {
+        return 0;
+    }
+    *position += data_length;
+    return 1;
+}
+
+// Compresses data_size bytes of in_file into a single zlib stream (level 9) using multiple threads.
+// The stream gets xor'd with xor_key (if not NULL) while it is produced and is written to out_file starting at out_offset.
+// The input is mapped and dropped again behind the dictionary of the next batch, and the compressed blocks are written out as
+// soon as a batch is done, so only the output of thread count * 128k of input is in memory at a time, whatever the file size.
+// The result doesn't depend on the amount of threads used.
+// Returns 0 if the file couldn't be read or the stream couldn't be written, otherwise *compressed_size is the size of the stream.
+_Bool compress_file_parallel(int in_file, uint64_t data_size, int out_file, uint64_t out_offset, const Byte *xor_key, uint64_t *compressed_size)
+{
+    static const Byte no_input[1];
+    const Byte *input = no_input;
+    if (data_size) {
+        input = mmap(NULL, data_size, PROT_READ, MAP_PRIVATE, in_file, 0);
+        if (input == MAP_FAILED) {
+            return 0;
+        }
+        madvise((void *) input, data_size, MADV_SEQUENTIAL);
+    }
+    uint64_t page_size = sysconf(_SC_PAGESIZE);
+    uint64_t dropped = 0; // input before this was already dropped from memory
+
+    int batch_blocks = get_thread_count();
+    deflate_block blocks[batch_blocks];
+    uLong block_capacity = compressBound(DEFLATE_BLOCK_SIZE) + 16; // some extra space for the sync flush marker
+    for (int i = 0; i < batch_blocks; i++) {
+        blocks[i].output = malloc(block_capacity);
+        blocks[i].output_capacity = block_capacity;
+        blocks[i].failed = 0;
+    }
+
+    uint64_t position = out_offset;
+    Byte zlib_header[2] = {0x78, 0xda}; // deflate with 32k window, maximum compression level
+    _Bool success = write_xored(out_file, zlib_header, 2, xor_key, &position, out_offset);
+    uLong adler = adler32(0L, Z_NULL, 0);
+
+    uint64_t processed = 0;
+    while (success) {
+        uint64_t batch_size = data_size - processed;
+        if (batch_size > (uint64_t) batch_blocks * DEFLATE_BLOCK_SIZE) {
+            batch_size = (uint64_t) batch_blocks * DEFLATE_BLOCK_SIZE;
+        }
+
+        int block_amount = batch_size ? (batch_size + DEFLATE_BLOCK_SIZE - 1) / DEFLATE_BLOCK_SIZE : 1;
+        for (int i = 0; i < block_amount; i++) {
+            uint64_t block_start = processed + (uint64_t) i * DEFLATE_BLOCK_SIZE;
+            blocks[i].input = &input[block_start];
+            blocks[i].input_size = data_size - block_start < DEFLATE_BLOCK_SIZE ? data_size - block_start : DEFLATE_BLOCK_SIZE;
+            blocks[i].dictionary_size = block_start < DEFLATE_WINDOW_SIZE ? block_start : DEFLATE_WINDOW_SIZE;
+            blocks[i].last = block_start + blocks[i].input_size == data_size;
+        }
+
+        run_parallel(deflate_block_worker, blocks, block_amount);
+
+        for (int i = 0; i < block_amount && success; i++) {
+            success = !blocks[i].failed && write_xored(out_file, blocks[i].output, blocks[i].output_size, xor_key, &position, out_offset);
+            adler = adler32_combine(adler, blocks[i].adler, blocks[i].input_size);
+        }
+        processed += batch_size;
+        if (processed == data_size) {
+            break;
+        }
+
+        // only the last 32k of input is needed anymore, as the dictionary for the next batch
+        uint64_t drop_end = (processed - DEFLATE_WINDOW_SIZE) / page_size * page_size;
+        if (drop_end > dropped) {
+            madvise((void *) &input[dropped], drop_end - dropped, MADV_DONTNEED);
+            dropped = drop_end;
+        }
+    }
+
+    Byte adler_bytes[4];
+    for (int i = 0; i < 4; i++) { // adler32 is stored big endian
+        adler_bytes[i] = (adler >> ((3 - i) * 8)) & 0xff;
+    }
+    success = success && write_xored(out_file, adler_bytes, 4, xor_key, &position, out_offset);
+
+    for (int i = 0; i < batch_blocks; i++) {
+        free(blocks[i].output);
+    }
+    if (data_size) {
+        munmap((void *) input, data_size);
+    }
+
+    *compressed_size = position - out_offset;
+    return success;
+}
+
+
+// Compressed payloads are cached in cache_directory (--cache) under the sha256 of their input and the compression parameters,
+// so the same rom doesn't have to be compressed again for every psb.m. They are stored before getting xor'd, the key depends
+// on the subfile name. Entries are written to a temporary file and renamed, so readers never need a lock; writers hold an
+// exclusive flock on "lock" in the directory while they add an entry and evict the least recently used ones (by mtime,
+// which gets bumped on every hit) until the directory is below cache_size_limit again.
+#define PAYLOAD_CACHE_MAGIC "PSBZ"
+#define PAYLOAD_CACHE_KEY_LENGTH 64
+
+struct _cached_payload_header {
+    char magic[4];
+    uint32_t uncompressed_size;
+    uint32_t compressed_size;
+    uint32_t crc; // crc32 of the compressed payload
+};
+
+struct _cached_payload_entry {
+    char name[PAYLOAD_CACHE_KEY_LENGTH + 1];
+    struct timespec mtime;
+    uint64_t size;
+};
+
+// Hashes everything in in_file together with the compression parameters (they change the output); rewinds in_file afterwards
+static void get_payload_cache_key(FILE *in_file, char key[PAYLOAD_CACHE_KEY_LENGTH + 1])
+{
+    char parameters[128];
+    int parameters_length = sprintf(parameters, "zlib level=9 window_bits=15 mem_level=8 strategy=%d block_size=%d window_size=%d",
+        Z_DEFAULT_STRATEGY, DEFLATE_BLOCK_SIZE, DEFLATE_WINDOW_SIZE);
+
+    EVP_MD_CTX *context = EVP_MD_CTX_new();
+    EVP_DigestInit_ex(context, EVP_sha256(), NULL);
+    EVP_DigestUpdate(context, parameters, parameters_length + 1);
+    Byte *buffer = malloc(MDF_CHUNK_SIZE);
+    size_t read_size;
+    while ((read_size = fread(buffer, 1, MDF_CHUNK_SIZE, in_file)) > 0) {
+        EVP_DigestUpdate(context, buffer, read_size);
+    }
+    free(buffer);
+    unsigned char digest[32];
+    EVP_DigestFinal_ex(context, digest, NULL);
+    EVP_MD_CTX_free(context);
+    rewind(in_file);
+
+    for (int i = 0; i < 32; i++) {
+        sprintf(&key[i * 2], "%02x", digest[i]);
+    }
+}
+
+// Copies the cached payload for key to out_file at out_offset, xor'd with xor_key on the way; returns its size, or 0 if it isn't
+// cached (or broken)
+static uint32_t read_cached_payload(const char *key, uint32_t uncompressed_size, int out_file, uint64_t out_offset, const Byte *xor_key)
+{
+    char entry_name[strlen(cache_directory) + PAYLOAD_CACHE_KEY_LENGTH + 2];
+    sprintf(entry_name, "%s/%s", cache_directory, key);
+    int entry_file = open(entry_name, O_RDONLY);
+    if (entry_file == -1) {
+        return 0;
+    }
+
+    struct _cached_payload_header header;
+    struct stat entry_stat;
+    fstat(entry_file, &entry_stat);
+    if (pread(entry_file, &header, sizeof(header), 0) != sizeof(header) || memcmp(header.magic, PAYLOAD_CACHE_MAGIC, 4) != 0
+        || header.uncompressed_size != uncompressed_size || entry_stat.st_size != (off_t) (sizeof(header) + header.compressed_size)) {
+        close(entry_file);
+        return 0;
+    }
+    uLong crc = crc32(0L, Z_NULL, 0);
+    if (!copy_payload(entry_file, sizeof(header), out_file, out_offset, header.compressed_size, xor_key, 0, &crc) || crc != header.crc) {
+        close(entry_file);
+        return 0;
+    }
+    futimens(entry_file, NULL); // it's the most recently used entry now
+    close(entry_file);
+    return header.compressed_size;
+}
+
+static int compare_cached_payload_entries(const void *a, const void *b)
+{
+    const struct _cached_payload_entry *entry_a = a;
+    const struct _cached_payload_entry *entry_b = b;
+    if (entry_a->mtime.tv_sec != entry_b->mtime.tv_sec) {
+        return entry_a->mtime.tv_sec < entry_b->mtime.tv_sec ? -1 : 1;
+    }
+    return (entry_a->mtime.tv_nsec > entry_b->mtime.tv_nsec) - (entry_a->mtime.tv_nsec < entry_b->mtime.tv_nsec);
+}
+
+// Removes the least recently used entries until the cache fits into cache_size_limit, except for kept_key (the entry that was
+// just added); the caller holds the lock
+static void evict_cached_payloads(const char *kept_key)
+{
+    DIR *directory = opendir(cache_directory);
+    if (directory == NULL) {
+        return;
+    }
+    struct _cached_payload_entry *entries = NULL;
+    int entry_amount = 0;
+    int entry_capacity = 0;
+    uint64_t total_size = 0;
+    struct dirent *directory_entry;
+    while ((directory_entry = readdir(directory)) != NULL) {
+        // only entries are counted, not the lock or the temporary files of other writers
+        if (strlen(directory_entry->d_name) != PAYLOAD_CACHE_KEY_LENGTH || strspn(directory_entry->d_name, "0123456789abcdef") != PAYLOAD_CACHE_KEY_LENGTH) {
+            continue;
+        }
+        struct stat entry_stat;
+        if (fstatat(dirfd(directory), directory_entry->d_name, &entry_stat, 0) != 0 || !S_ISREG(entry_stat.st_mode)) {
+            continue;
+        }
+        if (strcmp(directory_entry->d_name, kept_key) == 0) {
+            total_size += entry_stat.st_size;
+            continue;
+        }
+        if (entry_amount == entry_capacity) {
+            entry_capacity = entry_capacity ? entry_capacity * 2 : 64;
+            entries = realloc(entries, entry_capacity * sizeof(struct _cached_payload_entry));
+        }
+        strcpy(entries[entry_amount].name, directory_entry->d_name);
+        entries[entry_amount].mtime = entry_stat.st_mtim;
+        entries[entry_amount].size = entry_stat.st_size;
+        total_size += entry_stat.st_size;
+        entry_amount++;
+    }
+
+    if (entry_amount) { // there might be nothing but the kept entry
+        qsort(entries, entry_amount, sizeof(struct _cached_payload_entry), compare_cached_payload_entries);
+    }
+    for (int i = 0; i < entry_amount && total_size > cache_size_limit; i++) {
+        if (unlinkat(dirfd(directory), entries[i].name, 0) == 0) {
+            total_size -= entries[i].size;
+            if (debug) {
+                printf("evicted cached payload %s (%"PRIu64" bytes)\n", entries[i].name, entries[i].size);
+            }
+        }
+    }
+    free(entries);
+    closedir(directory);
+}
+
+// Adds a payload (not xor'd yet) from payload_file at payload_offset to the cache and evicts old ones if needed; failing to do so
+// only prints a warning
+static void write_cached_payload(const char *key, uint32_t uncompressed_size, int payload_file, uint64_t payload_offset, uint32_t payload_size)
+{
+    // it would have to evict everything else and still not fit, so every run would write it only to remove it again
+    if (sizeof(struct _cached_payload_header) + (uint64_t) payload_size > cache_size_limit) {
+        if (debug) {
+            printf("payload of %"PRIu32" bytes is larger than the cache, not caching it\n", payload_size);
+        }
+        return;
+    }
+    int directory_length = strlen(cache_directory);
+    char lock_name[directory_length + 6];
+    char entry_name[directory_length + PAYLOAD_CACHE_KEY_LENGTH + 2];
+    char temp_entry_name[directory_length + PAYLOAD_CACHE_KEY_LENGTH + 30];
+    sprintf(lock_name, "%s/lock", cache_directory);
+    sprintf(entry_name, "%s/%s", cache_directory, key);
+    sprintf(temp_entry_name, "%s/%s.%ld.tmp", cache_directory, key, (long) getpid());
+
+    mkdir(cache_directory, 0777);
+    int lock_file = open(lock_name, O_RDWR | O_CREAT, 0666);
+    if (lock_file == -1 || flock(lock_file, LOCK_EX) != 0) {
+        fprintf(stderr, "Warning: couldn't lock the cache directory \"%s\", the payload won't be cached.\n", cache_directory);
+        if (lock_file != -1) {
+            close(lock_file);
+        }
+        return;
+    }
+
+    struct _cached_payload_header header;
+    memcpy(header.magic, PAYLOAD_CACHE_MAGIC, 4);
+    header.uncompressed_size = uncompressed_size;
+    header.compressed_size = payload_size;
+    // the crc is only known once the payload is copied, so the header comes last
+    uLong crc = crc32(0L, Z_NULL, 0);
+    int entry_file = open(temp_entry_name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    _Bool written = entry_file != -1 && copy_payload(payload_file, payload_offset, entry_file, sizeof(header), payload_size, NULL, 0, &crc);
+    header.crc = crc;
+    written = written && write_all(entry_file, (const Byte *) &header, sizeof(header), 0);
+    if (entry_file == -1 || close(entry_file) != 0 || !written || rename(temp_entry_name, entry_name) != 0) {
+        fprintf(stderr, "Warning: couldn't write to the cache directory \"%s\", the payload won't be cached.\n", cache_directory);
+        unlink(temp_entry_name);
+    } else {
+        evict_cached_payloads(key);
+    }
+
+    flock(lock_file, LOCK_UN);
+    close(lock_file);
+}
+
+
+// Replaces the subfile at index with the contents of file_name, compressed and encrypted like the original subfiles.
+// Offsets of the following subfiles are potentially broken afterwards, relayout_subfiles fixes them up.
+// Returns 0 (and leaves the subfile as it was) if file_name couldn't be read or compressed.
+_Bool replace_subfile(psb_injection *injection, int index, const char *file_name)
+{
+    psb_data *template = injection->template;
+    const char *subfile_name = template->names[template->file_info[index].name_index];
+
+    FILE *in_file = fopen(file_name, "rb");
+    if (in_file == NULL) {
+        fprintf(stderr, "Error: file \"%s\" can't be accessed. Make sure it exists and is accessable.\n", file_name);
+        return 0;
+    }
+
+    // figure out the length of the file, it is needed for the mdf header
+    fseek(in_file, 0, SEEK_END);
+    int file_size = ftell(in_file);
+    rewind(in_file);
+    printf("file size of \"%s\": %d\n", file_name, file_size);
+
+    Byte xor_key[80];
+    get_xor_key(subfile_name, xor_key);
+
+    // the compressed data goes right behind the 8 byte mdf header and is xor'd while compressing
+    int subfile_file = create_payload_file(injection);
+    Byte mdf_header[8];
+    memcpy(mdf_header, "mdf\x00", 4);
+    memcpy(&mdf_header[4], &file_size, 4);
+    if (subfile_file == -1 || !write_all(subfile_file, mdf_header, 8, 0)) {
+        fprintf(stderr, "Error: Couldn't create a temporary file in \"%s\".\n", injection->work_directory);
+        if (subfile_file != -1) {
+            close(subfile_file);
+        }
+        fclose(in_file);
+        return 0;
+    }
+    uint64_t final_size = 0;
+    _Bool compressed = 1;
+    if (cache_directory) {
+        char cache_key[PAYLOAD_CACHE_KEY_LENGTH + 1];
+        get_payload_cache_key(in_file, cache_key);
+        final_size = read_cached_payload(cache_key, file_size, subfile_file, 8, xor_key);
+        if (final_size) {
+            printf("Using the cached compressed data of \"%s\".\n", file_name);
+        } else {
+            // cached payloads have to be stored before they're xor'd, so that happens afterwards here
+            printf("Started compressing \"%s\" using %d thread(s)...\n", file_name, get_thread_count());
+            compressed = compress_file_parallel(fileno(in_file), file_size, subfile_file, 8, NULL, &final_size);
+            printf("Compression finished.\n");
+            if (compressed) {
+                write_cached_payload(cache_key, file_size, subfile_file, 8, final_size);
+                compressed = copy_payload(subfile_file, 8, subfile_file, 8, final_size, xor_key, 0, NULL);
+            }
+        }
+    } else {
+        printf("Started compressing \"%s\" using %d thread(s)...\n", file_name, get_thread_count());
+        compressed = compress_file_parallel(fileno(in_file), file_size, subfile_file, 8, xor_key, &final_size);
+        printf("Compression finished.\n");
+    }
+    fclose(in_file);
+    if (!compressed) {
+        fprintf(stderr, "Error: Couldn't compress \"%s\".\n", file_name);
+        close(subfile_file);
+        return 0;
+    }
+    printf("compressed size of \"%s\": %"PRIu64"\n", subfile_name, final_size);
+    replace_subfile_data(injection, index, subfile_file);
+
+    injection->lengths[index] = final_size + 8;
+    return 1;
+}
+
+// Moves the subfiles so that they follow each other again (at 2048 byte boundaries) after some of them changed their length
+void relayout_subfiles(psb_injection *injection)
+{
+    psb_data *template = injection->template;
+    for (int i = 0; i < template->file_info_amount - 1; i++) {
+        uint64_t next_offset = injection->offsets[i+1];
+
+        // our current offset is already correct because of the last pass (or it's 0, which is always correct)
+        uint64_t potential_next_offset = injection->offsets[i] + injection->lengths[i];
+        if (next_offset < potential_next_offset || potential_next_offset + 2048 <= next_offset) {
+            // 1. the next offset will have to be bumped, the current length is too high to fit ||
+            // 2. the next offset will have to be lowered, it's too high for our smaller length
+
+            if (potential_next_offset % 2048 == 0) {
+                injection->offsets[i+1] = potential_next_offset;
+            } else {
+                injection->offsets[i+1] = ((potential_next_offset / 2048) + 1) * 2048;
+            }
+        }
+    }
+
+    // Debug file_info output
+    if (debug) {
+        printf("file info after rom injection:\n");
+        for (int i = 0; i < template->file_info_amount; i++) {
+            printf("file_info[%03d]: (name_index = %3u, offset = %8"PRIu64", length = %7"PRIu64"); string = \"%s\"\n", i, template->file_info[i].name_index, injection->offsets[i], injection->lengths[i], template->names[template->file_info[i].name_index]);
+        }
+    }
+}
+
+// Returns the index of the rom subfile (the first one in system/roms/), or -1 if the psb doesn't have one
+int find_rom_subfile(psb_data *template)
+{
+    uint32_t first_rom;
+    if (find_file_info_prefix(template, "system/roms/", &first_rom) == 0) {
+        fprintf(stderr, "Warning: the psb doesn't contain a rom, nothing got injected.\n");
+        return -1;
+    }
+    return template->file_info_by_name[first_rom];
+}
+
+
+// Extracting writes every subfile to <directory>/<its name>, uncompressed and decrypted; the subfiles are spread over all
+// threads, every one of them reads its part of the bin with pread through an mdf_reader.
+struct _extraction {
+    psb_data *psb;
+    const char *directory;
+    int failed_subfiles;
+    uint64_t bytes_written;
+};
+
+// names come from the psb, so they must not lead outside of the output directory
+static _Bool is_safe_subfile_name(const char *name)
+{
+    if (name[0] == '\0' || name[0] == '/' || name[0] == '\\') {
+        return 0;
+    }
+    for (const char *component = name; component; component = strpbrk(component, "/\\")) {
+        component += component != name;
+        if (strncmp(component, "..", 2) == 0 && (component[2] == '\0' || component[2] == '/' || component[2] == '\\')) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// creates all directories of path (but not its last component) that don't exist yet
+static void create_parent_directories(char *path)
+{
+    for (char *slash = strchr(path + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        mkdir(path, 0777); // it's fine if it exists already, e.g. because another thread just created it
+        *slash = '/';
+    }
+}
+
+static void extract_subfile_worker(void *context, int index)
+{
+    struct _extraction *extraction = context;
+    psb_data *my_psb_data = extraction->psb;
+    const char *name = my_psb_data->names[my_psb_data->file_info[index].name_index];
+    if (!is_safe_subfile_name(name)) {
+        fprintf(stderr, "Warning: skipping subfile \"%s\", its name leads outside of the output directory.\n", name);
+        __atomic_fetch_add(&extraction->failed_subfiles, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    char path[strlen(extraction->directory) + strlen(name) + 2];
+    sprintf(path, "%s/%s", extraction->directory, name);
+    create_parent_directories(path);
+    FILE *out_file = fopen(path, "wb");
+    if (out_file == NULL) {
+        fprintf(stderr, "Warning: couldn't create \"%s\".\n", path);
+        __atomic_fetch_add(&extraction->failed_subfiles, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    uint64_t written = 0;
+    _Bool success = 1;
+    mdf_reader *reader = malloc(sizeof(mdf_reader));
+    if (mdf_open_subfile(reader, my_psb_data, index)) {
+        Byte *buffer = malloc(MDF_CHUNK_SIZE);
+        uLong read_size;
+        while ((read_size = mdf_read(reader, buffer, MDF_CHUNK_SIZE)) > 0) {
+            success &= fwrite(buffer, read_size, 1, out_file) == 1;
+            written += read_size;
+        }
+        if (written != reader->uncompressed_size) {
+            fprintf(stderr, "Warning: \"%s\" is %"PRIu64" bytes long instead of the %u bytes in its header.\n", name, written, reader->uncompressed_size);
+        }
+        success &= !reader->failed;
+        mdf_close(reader);
+        free(buffer);
+    } else {
+        // not an mdf file, so it's written as it is
+        written = get_file_info_length(my_psb_data, index);
+        success = written == 0 || fwrite(my_psb_data->subfile_data[index], written, 1, out_file) == 1;
+    }
+    free(reader);
+
+    if (fclose(out_file) != 0 || !success) {
+        fprintf(stderr, "Warning: couldn't write \"%s\".\n", path);
+        __atomic_fetch_add(&extraction->failed_subfiles, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    __atomic_fetch_add(&extraction->bytes_written, written, __ATOMIC_RELAXED);
+    if (debug) {
+        printf("extracted \"%s\" (%"PRIu64" bytes)\n", name, written);
+    }
+}
+
+// Extracts all subfiles to directory; returns the amount of subfiles that couldn't be extracted
+int extract_subfiles(psb_data *my_psb_data, const char *directory)
+{
+    struct _extraction extraction = {my_psb_data, directory, 0, 0};
+    mkdir(directory, 0777);
+    printf("Extracting %d subfile(s) to \"%s\" using %d thread(s)...\n", my_psb_data->file_info_amount, directory, get_thread_count());
+
+    struct timespec start_time, end_time;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    run_parallel(extract_subfile_worker, &extraction, my_psb_data->file_info_amount);
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+    double seconds = (end_time.tv_sec - start_time.tv_sec) + (end_time.tv_nsec - start_time.tv_nsec) / 1e9;
+
+    printf("Extracted %d subfile(s), %"PRIu64" bytes in %.2f s.\n", my_psb_data->file_info_amount - extraction.failed_subfiles, extraction.bytes_written, seconds);
+    return extraction.failed_subfiles;
+}
+
+
+// Times every xor kernel the cpu supports against the plain byte loop and checks that they all agree
+void benchmark_xor(void)
+{
+    struct {
+        const char *name;
+        void (*function)(Byte *, const Byte *, uLong, uLong);
+        _Bool supported;
+    } kernels[] = {
+        {"scalar", xor_data_scalar, 1},
+#if defined(__x86_64__) || defined(__i386__)
+        {"sse2", xor_data_sse2, __builtin_cpu_supports("sse2")},
+        {"avx2", xor_data_avx2, __builtin_cpu_supports("avx2")},
+#endif
+    };
+    const uLong data_length = 64 * 1024 * 1024;
+    const int rounds = 8;
+
+    Byte xor_key[80];
+    get_xor_key("alldata.psb.m", xor_key);
+    Byte *reference = malloc(data_length + 1);
+    Byte *data = malloc(data_length + 1);
+    for (uLong i = 0; i < data_length + 1; i++) {
+        reference[i] = i * 2654435761u >> 24;
+    }
+    xor_data_scalar(&reference[1], xor_key, data_length, 7);
+
+    for (int k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+        if (!kernels[k].supported) {
+            printf("%-8s not supported by this cpu\n", kernels[k].name);
+            continue;
+        }
+        // starting at data + 1 and key position 7 makes sure the unaligned head and the tail get used as well
+        for (uLong i = 0; i < data_length + 1; i++) {
+            data[i] = i * 2654435761u >> 24;
+        }
+        kernels[k].function(&data[1], xor_key, data_length, 7);
+        _Bool correct = memcmp(data, reference, data_length + 1) == 0;
+
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int round = 0; round < rounds; round++) {
+            kernels[k].function(&data[1], xor_key, data_length, 7);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        printf("%-8s %6.2f GB/s%s\n", kernels[k].name, (double) data_length * rounds / seconds / 1e9, correct ? "" : "  (WRONG RESULT)");
+    }
+
+    free(reference);
+    free(data);
+}
+
+
+// a subfile to replace, given with --replace
+struct _subfile_replacement {
+    int index;
+    const char *file_name;
+};
+
+typedef struct _subfile_replacement subfile_replacement;
+
+struct _replacement_pass {
+    psb_injection *injection;
+    const subfile_replacement *replacements;
+    int *threads; // compression threads of every replacement, 0 if a later replacement of the same subfile overrides it
+    _Bool *failed;
+};
+
+static void replace_subfile_worker(void *context, int index)
+{
+    struct _replacement_pass *pass = context;
+    if (pass->threads[index] == 0) {
+        return;
+    }
+    int previous_thread_count = local_thread_count;
+    local_thread_count = pass->threads[index];
+    pass->failed[index] = !replace_subfile(pass->injection, pass->replacements[index].index, pass->replacements[index].file_name);
+    local_thread_count = previous_thread_count;
+}
+
+// Replaces all the given subfiles at the same time, every one of them gets a share of the threads that fits its size.
+// When a subfile is in there more than once, the last replacement wins, just like when replacing them one by one.
+// relayout_subfiles has to be called afterwards, once for all of them. Returns 0 if any of them couldn't be replaced.
+_Bool replace_subfiles(psb_injection *injection, const subfile_replacement *replacements, int amount)
+{
+    if (amount == 0) {
+        return 1;
+    }
+    int thread_amount = get_thread_count();
+    uint64_t sizes[amount];
+    uint64_t total_size = 0;
+    int threads[amount];
+    _Bool failed[amount];
+    for (int i = 0; i < amount; i++) {
+        threads[i] = 1;
+        failed[i] = 0;
+        for (int j = i + 1; j < amount; j++) {
+            if (replacements[j].index == replacements[i].index) {
+                threads[i] = 0;
+            }
+        }
+        struct stat file_stat;
+        sizes[i] = threads[i] && stat(replacements[i].file_name, &file_stat) == 0 ? file_stat.st_size : 0;
+        total_size += sizes[i];
+    }
+    for (int i = 0; i < amount; i++) {
+        if (threads[i] && total_size && thread_amount * sizes[i] / total_size > 1) {
+            threads[i] = thread_amount * sizes[i] / total_size;
+        }
+    }
+
+    struct _replacement_pass pass = {injection, replacements, threads, failed};
+    run_parallel(replace_subfile_worker, &pass, amount);
+    for (int i = 0; i < amount; i++) {
+        if (failed[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Makes one injection out of the template and writes it to out_name; the rom is optional.
+// With in_place, out_name has to be the psb.m of the template; the bin is then only patched if the new subfiles fit.
+// Returns 0 if a subfile couldn't be replaced or the output couldn't be written, the reason is printed already.
+// The bin goes first, so the psb.m never points into a bin that failed.
+_Bool run_injection(psb_data *template, const char *rom_name, const subfile_replacement *replacements, int replacement_amount, const char *out_name, _Bool in_place)
+{
+    psb_injection *injection = create_injection(template, out_name);
+
+    // the rom goes first, so that a replacement of the rom subfile overrides it
+    subfile_replacement all_replacements[replacement_amount + 1];
+    int amount = 0;
+    if (rom_name) {
+        printf("Reading in rom file \"%s\".\n", rom_name);
+        int rom_index = find_rom_subfile(template);
+        if (rom_index != -1) {
+            all_replacements[amount++] = (subfile_replacement) {rom_index, rom_name};
+        }
+    }
+    for (int i = 0; i < replacement_amount; i++) {
+        all_replacements[amount++] = replacements[i];
+    }
+    if (!replace_subfiles(injection, all_replacements, amount)) {
+        free_injection(injection);
+        return 0;
+    }
+
+    _Bool success;
+    if (in_place && fits_in_place(injection)) {
+        // the psb.m is written before the bin is touched, so a failure there leaves both as they were; it only
+        // replaces the old one once the bin is patched
+        char *temp_psb_name;
+        success = prepare_psb(injection, out_name, &temp_psb_name);
+        if (success) {
+            success = commit_psb(temp_psb_name, out_name, patch_bin_in_place(injection, out_name));
+        }
+    } else {
+        relayout_subfiles(injection);
+        success = pack_bin(injection, out_name) && pack_psb(injection, out_name);
+    }
+    free_injection(injection);
+    return success;
+}
+
+// one line of a batch manifest
+struct _batch_job {
+    char *psb_name; // NULL to use the one from the command line
+    char *rom_name;
+    char *out_name;
+    int line_number;
+};
+
+typedef struct _batch_job batch_job;
+
+_Bool has_psb_m_ending(const char *file_name)
+{
+    return strlen(file_name) >= 6 && strcmp(&file_name[strlen(file_name) - 6], ".psb.m") == 0;
+}
+
+// Reads a batch manifest, where every line is "[<psb.m to inject into><tab>]<rom to inject><tab><output psb.m>";
+// empty lines and lines starting with # are skipped
+batch_job *read_manifest(const char *manifest_name, int *job_amount)
+{
+    FILE *manifest = fopen(manifest_name, "r");
+    if (manifest == NULL) {
+        fprintf(stderr, "Error: file \"%s\" can't be accessed. Make sure it exists and is accessable.\n", manifest_name);
+        exit(EXIT_FAILURE);
+    }
+
+    batch_job *jobs = NULL;
+    int job_capacity = 0;
+    *job_amount = 0;
+    char *line = NULL;
+    size_t line_capacity = 0;
+    for (int line_number = 1; getline(&line, &line_capacity, manifest) != -1; line_number++) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#') {
+            continue;
+        }
+
+        char *fields[3];
+        int field_amount = 0;
+        for (char *field = line; field && field_amount < 3; field_amount++) {
+            fields[field_amount] = field;
+            field = strchr(field, '\t');
+            if (field) {
+                *field++ = '\0';
+            }
+        }
+        if (field_amount < 2 || strchr(fields[field_amount - 1], '\t') || !has_psb_m_ending(fields[field_amount - 1])) {
+            fprintf(stderr, "Error: line %d of the manifest isn't in the form \"[<psb.m><tab>]<rom><tab><output psb.m>\". Will now terminate.\n", line_number);
+            exit(EXIT_FAILURE);
+        }
+        // the jobs run at the same time, two of them can't write the same files
+        for (int i = 0; i < *job_amount; i++) {
+            if (strcmp(jobs[i].out_name, fields[field_amount - 1]) == 0) {
+                fprintf(stderr, "Error: line %d of the manifest has the same output as line %d. Will now terminate.\n", line_number, jobs[i].line_number);
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        if (*job_amount == job_capacity) {
+            job_capacity = job_capacity ? job_capacity * 2 : 16;
+            jobs = realloc(jobs, job_capacity * sizeof(batch_job));
+        }
+        jobs[*job_amount].psb_name = field_amount == 3 ? strdup(fields[0]) : NULL;
+        jobs[*job_amount].rom_name = strdup(fields[field_amount - 2]);
+        jobs[*job_amount].out_name = strdup(fields[field_amount - 1]);
+        jobs[*job_amount].line_number = line_number;
+        (*job_amount)++;
+    }
+
+    free(line);
+    fclose(manifest);
+    return jobs;
+}
+
+static double get_seconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Batch jobs run at the same time, on as many threads as there are cpu cores; the threads of the compression get split
+// between them. Before a job starts it has to fit into the memory budget, together with the jobs that are still running;
+// a job that doesn't fit on its own only runs once nothing else does. The templates are loaded before any job starts;
+// the jobs of a template that can't be loaded fail, the others still run.
+struct _batch {
+    batch_job *jobs;
+    int job_amount;
+    psb_data **templates; // the template of every job, NULL if it couldn't be loaded
+    char **replacement_names;
+    char **replacement_files;
+    int replacement_amount;
+    int job_threads; // compression threads of every job
+    uint64_t memory_budget;
+
+    pthread_mutex_t lock; // guards everything below
+    pthread_cond_t memory_freed;
+    uint64_t memory_in_flight;
+    int finished_jobs;
+    int failed_jobs;
+    uint64_t input_bytes; // read by the successful jobs
+};
+
+typedef struct _batch batch;
+
+// a rough upper bound of what a job keeps in memory: the compressed subfiles go to temporary files, so that's the mapped input
+// and the output buffers of its compression threads and the buffers for copying the subfiles around, and then pack_psb with
+// the packed psb (about as large as the one of the template) and its compressed copy, and the psb_pack_state and the
+// positions of pack_entries for every node
+static uint64_t estimate_batch_job_memory(psb_data *template, int replaced_files, int threads)
+{
+    uint64_t packed_psb_size = template->raw_psb_data->raw_psb_size + 16; // the entries might grow by a few bytes
+    uint64_t node_size = sizeof(uint8_t) + sizeof(uint64_t) + sizeof(uint32_t) + sizeof(uint8_t) + sizeof(uint8_t) + sizeof(uint32_t);
+    return DEFLATE_WINDOW_SIZE + (uint64_t) threads * (DEFLATE_BLOCK_SIZE + compressBound(DEFLATE_BLOCK_SIZE) + 16)
+        + (uint64_t) replaced_files * MDF_CHUNK_SIZE
+        + packed_psb_size + 8 + compressBound(packed_psb_size) + (uint64_t) template->entries.amount * node_size;
+}
+
+// whether the psb.m and the bin (which is written as "<bin>.tmp" and renamed) can be created where out_name points to
+static _Bool can_write_output(const char *out_name)
+{
+    char *directory_name = strdup(out_name);
+    char *separator = strrchr(directory_name, '/');
+    const char *directory = ".";
+    if (separator) {
+        separator[separator == directory_name] = '\0'; // "/x.psb.m" is in "/"
+        directory = directory_name;
+    }
+    _Bool writable = access(directory, W_OK | X_OK) == 0 && (access(out_name, F_OK) != 0 || access(out_name, W_OK) == 0);
+    free(directory_name);
+    return writable;
+}
+
+static void batch_job_worker(void *context, int index)
+{
+    batch *my_batch = context;
+    batch_job *job = &my_batch->jobs[index];
+    psb_data *template = my_batch->templates[index];
+    int previous_thread_count = local_thread_count;
+    local_thread_count = my_batch->job_threads;
+
+    // the obvious problems are checked first, so a broken job doesn't get to take up memory; anything that still goes
+    // wrong later (the files can change in the meantime) only makes run_injection fail, which fails this job as well
+    const char *error = NULL;
+    uint64_t input_size = 0;
+    struct stat file_stat;
+    if (template == NULL) {
+        error = "the psb.m couldn't be loaded";
+    } else if (stat(job->rom_name, &file_stat) != 0 || access(job->rom_name, R_OK) != 0) {
+        error = "the rom can't be accessed";
+    } else {
+        input_size += file_stat.st_size;
+    }
+    subfile_replacement replacements[my_batch->replacement_amount + 1];
+    for (int i = 0; i < my_batch->replacement_amount && !error; i++) {
+        replacements[i].index = find_file_info(template, my_batch->replacement_names[i]);
+        replacements[i].file_name = my_batch->replacement_files[i];
+        if (replacements[i].index == -1) {
+            error = "a subfile to replace isn't in the psb";
+        } else if (stat(replacements[i].file_name, &file_stat) != 0 || access(replacements[i].file_name, R_OK) != 0) {
+            error = "a file to replace a subfile with can't be accessed";
+        } else {
+            input_size += file_stat.st_size;
+        }
+    }
+    if (!error && !can_write_output(job->out_name)) {
+        error = "the output can't be written";
+    }
+
+    uint64_t memory = error ? 0 : estimate_batch_job_memory(template, my_batch->replacement_amount + 1, my_batch->job_threads);
+    pthread_mutex_lock(&my_batch->lock);
+    while (my_batch->memory_in_flight && my_batch->memory_in_flight + memory > my_batch->memory_budget) {
+        pthread_cond_wait(&my_batch->memory_freed, &my_batch->lock);
+    }
+    my_batch->memory_in_flight += memory;
+    pthread_mutex_unlock(&my_batch->lock);
+    double start_time = get_seconds();
+
+    if (!error && !run_injection(template, job->rom_name, replacements, my_batch->replacement_amount, job->out_name, 0)) {
+        error = "the injection failed";
+    }
+
+    // the status lines come out in the order the jobs finish
+    pthread_mutex_lock(&my_batch->lock);
+    my_batch->memory_in_flight -= memory;
+    my_batch->finished_jobs++;
+    if (error) {
+        my_batch->failed_jobs++;
+        printf("Batch job %d/%d failed (line %d of the manifest): \"%s\" -> \"%s\": %s.\n", my_batch->finished_jobs, my_batch->job_amount, job->line_number, job->rom_name, job->out_name, error);
+    } else {
+        my_batch->input_bytes += input_size;
+        printf("Batch job %d/%d done: \"%s\" -> \"%s\" in %.2f s.\n", my_batch->finished_jobs, my_batch->job_amount, job->rom_name, job->out_name, get_seconds() - start_time);
+    }
+    pthread_cond_broadcast(&my_batch->memory_freed);
+    pthread_mutex_unlock(&my_batch->lock);
+    local_thread_count = previous_thread_count;
+}
 
-        uint32_t pass_value = 0;
-        Byte *new_pointer;
-        for (int i = 0; i < names->value_length; i++) {
-            if (strcmp(my_psb_data->names[names->value.integer_array[i]], "file_info") == 0) {
-                pass_value = 1;
-            }
-            name_object *this_name_object = malloc(sizeof(name_object));
-            this_name_object->name_index = names->value.integer_array[i];
-            if (debug) {
-                printf("Currently unpacking information for entry \"%s\".\n", my_psb_data->names[this_name_object->name_index]);
-            }
+// Runs all jobs of a manifest, jobs without a psb.m of their own use default_psb_name; replacements are "name=file".
+// Returns the amount of failed jobs.
+int run_batch(batch_job *jobs, int job_amount, const char *default_psb_name, char **replacements, int replacement_amount, uint64_t memory_budget)
+{
+    batch my_batch = {jobs, job_amount, malloc(job_amount * sizeof(psb_data *)), malloc(replacement_amount * sizeof(char *)), malloc(replacement_amount * sizeof(char *)), replacement_amount};
+    for (int i = 0; i < replacement_amount; i++) {
+        char *separator = strchr(replacements[i], '=');
+        *separator = '\0';
+        my_batch.replacement_names[i] = replacements[i];
+        my_batch.replacement_files[i] = separator + 1;
+    }
 
-            new_pointer = (*pointer) + offsets->value.integer_array[i];
+    // every template is loaded once, no matter how many jobs use it
+    const char **psb_names = malloc(job_amount * sizeof(char *));
+    psb_data **loaded_templates = malloc(job_amount * sizeof(psb_data *));
+    int template_amount = 0;
+    for (int i = 0; i < job_amount; i++) {
+        const char *psb_name = jobs[i].psb_name ? jobs[i].psb_name : default_psb_name;
+        if (psb_name == NULL) {
+            fprintf(stderr, "Error: line %d of the manifest has no psb.m and there is none on the command line. Will now terminate.\n", jobs[i].line_number);
+            exit(EXIT_FAILURE);
+        }
+        int template = 0;
+        while (template < template_amount && strcmp(psb_names[template], psb_name) != 0) {
+            template++;
+        }
+        if (template == template_amount) {
+            psb_names[template_amount] = psb_name;
+            loaded_templates[template_amount++] = try_load_from_psb(psb_name);
+        }
+        my_batch.templates[i] = loaded_templates[template];
+    }
 
-            this_name_object->object = extract_data(my_psb_data, &new_pointer, &pass_value);
-            this_name_object->name_string = my_psb_data->names[this_name_object->name_index];
+    int worker_amount = get_thread_count() < job_amount ? get_thread_count() : job_amount;
+    my_batch.job_threads = worker_amount ? get_thread_count() / worker_amount : 1;
+    my_batch.memory_budget = memory_budget;
+    pthread_mutex_init(&my_batch.lock, NULL);
+    pthread_cond_init(&my_batch.memory_freed, NULL);
+    printf("Running %d batch job(s) on %d thread(s) with a memory budget of %"PRIu64" MiB.\n", job_amount, worker_amount, memory_budget / 1024 / 1024);
+
+    double start_time = get_seconds();
+    run_parallel(batch_job_worker, &my_batch, job_amount);
+    double seconds = get_seconds() - start_time;
+    printf("Batch finished: %d job(s), %d failed, in %.2f s (%.2f jobs/s, %.2f MB/s of input).\n", job_amount, my_batch.failed_jobs, seconds,
+        seconds > 0 ? job_amount / seconds : 0.0, seconds > 0 ? my_batch.input_bytes / seconds / 1e6 : 0.0);
+
+    pthread_cond_destroy(&my_batch.memory_freed);
+    pthread_mutex_destroy(&my_batch.lock);
+    for (int i = 0; i < template_amount; i++) {
+        if (loaded_templates[i]) {
+            free_psb_data(loaded_templates[i]);
+        }
+    }
+    free(loaded_templates);
+    free(psb_names);
+    free(my_batch.templates);
+    free(my_batch.replacement_names);
+    free(my_batch.replacement_files);
+    return my_batch.failed_jobs;
+}
 
-            return_type_value->value.name_object_array[i] = this_name_object;
 
-            if (is_file_info) {
-                // sanity check the file_info object
-                assert(this_name_object->object->type == 32);
-                assert(this_name_object->object->value_length == 2);
-                assert(this_name_object->object->value.type_value_array[0]->type >= 4);
-                assert(this_name_object->object->value.type_value_array[0]->type <= 12);
-                assert(this_name_object->object->value.type_value_array[1]->type >= 4);
-                assert(this_name_object->object->value.type_value_array[1]->type <= 12);
+// Daemon mode (--daemon <socket>): templates stay loaded between jobs, which are sent over a unix socket (--client).
+// Every message in either direction is a frame: a 4 byte little endian length followed by that many bytes.
+// Requests start with their type; an inject request is followed by the template psb.m, the rom and the output psb.m,
+// each null terminated. Responses are a status byte (0 on success) followed by a text message.
+// Every job runs in a child process forked off the daemon: it uses the loaded templates without copying them, and it can
+// simply exit on errors like everything else in here does without taking the daemon down with it.
+#define DAEMON_REQUEST_INJECT 1
+#define DAEMON_REQUEST_STATS 2
+#define DAEMON_MAX_FRAME_SIZE (64 * 1024)
+// clients get a thread each, up to this many at the same time; further connections wait in the listen backlog
+#define DAEMON_MAX_CLIENTS 64
+
+struct _daemon_template {
+    char *psb_name;
+    psb_data *psb; // NULL until it's loaded successfully
+    _Bool loading; // by one of the jobs, without the daemon lock; the other jobs for it wait for template_loaded
+};
 
-                file_info *new_file_info = malloc(sizeof(file_info));
+struct _daemon_state {
+    // template loads hold this exclusively and forks hold it shared: a child forked in the middle of a load could
+    // inherit a lock of malloc, OpenSSL or the thread pool that the loading thread holds, and wait for it forever
+    pthread_rwlock_t fork_lock;
+    // guards everything below; it's only held for the bookkeeping and around forks, never while a template gets loaded
+    pthread_mutex_t lock;
+    pthread_cond_t job_finished;
+    pthread_cond_t template_loaded;
+    pthread_cond_t client_finished;
+    _Bool stopped; // the templates are freed, nothing may use them anymore
+    int max_jobs;
+    int job_threads; // compression threads of every job
+    int client_threads;
+    int running_jobs;
+    int queued_jobs;
+    uint64_t finished_jobs;
+    uint64_t failed_jobs;
+    double total_latency; // in seconds
+    double max_latency;
+    struct _daemon_template **templates;
+    int template_amount;
+    int loading_templates;
+};
 
-                new_file_info->name_index = names->value.integer_array[i];
-                new_file_info->offset = &this_name_object->object->value.type_value_array[0]->value.long_integer;
-                new_file_info->length = &this_name_object->object->value.type_value_array[1]->value.long_integer;
+struct _daemon_state daemon_state = {PTHREAD_RWLOCK_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, NULL, 0, 0};
+volatile sig_atomic_t daemon_stopping = 0;
 
-                my_psb_data->file_info[i] = new_file_info;
+static _Bool read_exactly(int file, void *data, size_t length)
+{
+    while (length) {
+        ssize_t read_size = read(file, data, length);
+        if (read_size <= 0) {
+            if (read_size == -1 && errno == EINTR) {
+                continue;
             }
+            return 0;
         }
-        free(names->value.integer_array);
-        free(names);
-        free(offsets->value.integer_array);
-        free(offsets);
+        data = (Byte *) data + read_size;
+        length -= read_size;
     }
-
-    return return_type_value;
+    return 1;
 }
 
-
-void pack_bin(psb_data *my_psb_data, const char *out_file)
+static _Bool write_exactly(int file, const void *data, size_t length)
 {
-    int out_file_length = strlen(out_file);
-    char out_bin_name[out_file_length - 1];
-    memcpy(out_bin_name, out_file, out_file_length - 6);
-    strcpy(&out_bin_name[out_file_length - 6], ".bin");
-
-    FILE *out_bin_file = fopen(out_bin_name, "wb");
-    if (out_bin_file == NULL) {
-        fprintf(stderr, "Error: Couldn't open output bin file (%s). Will now terminate.\n", out_bin_name);
-        exit(EXIT_FAILURE);
-    }
-    printf("Writing out bin file \"%s\".\n", out_bin_name);
-
-    const Byte null_data[2048] = {0};
-    for (int i = 0; i < my_psb_data->file_info_amount; i++) {
-        fwrite(my_psb_data->subfile_data[i], *my_psb_data->file_info[i]->length, 1, out_bin_file);
-        if (*my_psb_data->file_info[i]->length % 2048 != 0) {
-            fwrite(null_data, 2048 - (*my_psb_data->file_info[i]->length % 2048), 1, out_bin_file);
+    while (length) {
+        ssize_t written_size = write(file, data, length);
+        if (written_size <= 0) {
+            if (written_size == -1 && errno == EINTR) {
+                continue;
+            }
+            return 0;
         }
+        data = (const Byte *) data + written_size;
+        length -= written_size;
     }
+    return 1;
+}
 
-    fclose(out_bin_file);
+static _Bool send_frame(int file, const Byte *data, uint32_t length)
+{
+    Byte length_bytes[4] = {length & 0xff, (length >> 8) & 0xff, (length >> 16) & 0xff, length >> 24};
+    return write_exactly(file, length_bytes, 4) && write_exactly(file, data, length);
 }
 
+// sends the status byte followed by the message
+// a message that doesn't fit into one frame gets cut off
+static _Bool send_response(int file, Byte status, const char *message)
+{
+    size_t message_length = strlen(message);
+    uint32_t length = (message_length < DAEMON_MAX_FRAME_SIZE ? message_length : DAEMON_MAX_FRAME_SIZE - 1) + 1;
+    Byte *response = malloc(length);
+    response[0] = status;
+    memcpy(&response[1], message, length - 1);
+    _Bool sent = send_frame(file, response, length);
+    free(response);
+    return sent;
+}
 
-void pack_psb(psb_data *my_psb_data, const char *out_name)
+// Returns the payload of the next frame (with a null byte behind it, which isn't part of the length), or NULL if there is none
+static Byte *receive_frame(int file, uint32_t *length)
 {
-    Byte *injected_psb_data = malloc(40);
-    uint32_t injected_psb_data_size = 40;
-    printf("Writing out psb.m file \"%s\".\n", out_name);
+    Byte length_bytes[4];
+    if (!read_exactly(file, length_bytes, 4)) {
+        return NULL;
+    }
+    *length = length_bytes[0] | length_bytes[1] << 8 | length_bytes[2] << 16 | (uint32_t) length_bytes[3] << 24;
+    if (*length > DAEMON_MAX_FRAME_SIZE) {
+        return NULL;
+    }
+    Byte *data = malloc(*length + 1);
+    if (!read_exactly(file, data, *length)) {
+        free(data);
+        return NULL;
+    }
+    data[*length] = '\0';
+    return data;
+}
 
-    // I will pack in a relatively lazy way, by re-using raw data saved earlier
-    // everything should still work perfectly fine though
+// The other client threads keep printing while one of them forks, so the locks a child needs right away are taken around
+// every fork; otherwise a child could inherit one held by another thread and wait for it forever. Loads, which take a
+// lot more locks, are kept out by the fork lock.
+static void lock_before_fork(void)
+{
+    pthread_mutex_lock(&xor_key_cache.lock);
+    flockfile(stdout);
+    flockfile(stderr);
+}
 
-    // I will pack the header later, as to avoid duplicate packing because of a potential offset difference due to a difference in file size
+static void unlock_after_fork(void)
+{
+    funlockfile(stderr);
+    funlockfile(stdout);
+    pthread_mutex_unlock(&xor_key_cache.lock);
+}
 
-    // pack_names function
-    // instead of packing manually, we just use our raw_names
-    injected_psb_data = realloc(injected_psb_data, injected_psb_data_size + my_psb_data->raw_psb_data->raw_names_size);
-    memcpy(&injected_psb_data[injected_psb_data_size], my_psb_data->raw_psb_data->raw_names, my_psb_data->raw_psb_data->raw_names_size);
-    injected_psb_data_size += my_psb_data->raw_psb_data->raw_names_size;
+// Forks a child that runs function(context) with its stdout going to /dev/null and its stderr into *error_pipe.
+// The daemon lock has to be held, so the templates don't change during the fork, and the fork lock has to be held shared.
+static pid_t fork_job(void (*function)(void *context), void *context, int *error_pipe)
+{
+    int pipe_files[2];
+    if (pipe(pipe_files) != 0) {
+        return -1;
+    }
+    fflush(stdout);
+    fflush(stderr);
+    pid_t child = fork();
+    if (child == 0) {
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        int null_file = open("/dev/null", O_WRONLY);
+        dup2(null_file, STDOUT_FILENO);
+        dup2(pipe_files[1], STDERR_FILENO);
+        close(null_file);
+        close(pipe_files[0]);
+        close(pipe_files[1]);
+        function(context);
+        // the child owns next to nothing of what it inherited, so there is nothing to clean up
+        fflush(NULL);
+        _exit(EXIT_SUCCESS);
+    }
+    close(pipe_files[1]);
+    if (child == -1) {
+        close(pipe_files[0]);
+        return -1;
+    }
+    *error_pipe = pipe_files[0];
+    return child;
+}
 
-    // pack_entries function
-    int size_entry_data = 0;
-    Byte *entry_data = pack_data(my_psb_data, my_psb_data->entries, &size_entry_data);
-    injected_psb_data = realloc(injected_psb_data, injected_psb_data_size + size_entry_data);
-    memcpy(&injected_psb_data[injected_psb_data_size], entry_data, size_entry_data);
-    free(entry_data);
-    injected_psb_data_size += size_entry_data;
-
-    uint8_t offset_difference = abs(injected_psb_data_size - my_psb_data->header->offset_strings);
-    if (offset_difference > 0) {
-        printf("updating offsets; filesize differs by %d.\n", offset_difference);
-        if (offset_difference > 1) {
-            fprintf(stderr, "The filesize difference was larger than 1. I believe that this should not happen. If issues occur, it's likely due to this.\n");
+// Waits for a child of fork_job; returns 1 if it exited successfully. Whatever it wrote to stderr ends up in *message (malloc'd).
+static _Bool wait_for_job(pid_t child, int error_pipe, char **message)
+{
+    size_t message_size = 0;
+    size_t message_capacity = 256;
+    *message = malloc(message_capacity);
+    ssize_t read_size;
+    while ((read_size = read(error_pipe, &(*message)[message_size], message_capacity - message_size - 1)) != 0) {
+        if (read_size == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        message_size += read_size;
+        if (message_size + 1 == message_capacity) {
+            message_capacity *= 2;
+            *message = realloc(*message, message_capacity);
         }
-        my_psb_data->header->offset_strings += offset_difference;
-        my_psb_data->header->offset_strings_data += offset_difference;
-        my_psb_data->header->offset_chunk_offsets += offset_difference;
-        my_psb_data->header->offset_chunk_lengths += offset_difference;
-        my_psb_data->header->offset_chunk_data += offset_difference;
     }
+    (*message)[message_size] = '\0';
+    close(error_pipe);
 
-    // pack_strings function
-    // we'll use our raw strings again
-    injected_psb_data = realloc(injected_psb_data, injected_psb_data_size + my_psb_data->raw_psb_data->raw_strings_size);
-    memcpy(&injected_psb_data[injected_psb_data_size], my_psb_data->raw_psb_data->raw_strings, my_psb_data->raw_psb_data->raw_strings_size);
-    injected_psb_data_size += my_psb_data->raw_psb_data->raw_strings_size;
-
-    // pack_chunks function
-    // because I believe alldata.psbs ALWAYS have absolutely no chunk data, we will append the according "empty" bytes
-    injected_psb_data = realloc(injected_psb_data, injected_psb_data_size + 6);
-    memcpy(&injected_psb_data[injected_psb_data_size], "\x0d\x00\x0d\x0d\x00\x0d", 6);
-    injected_psb_data_size += 6;
-    printf("injected (uncompressed) psb size: %d\n", injected_psb_data_size);
-
-    // we will pack the header now
-    memcpy(injected_psb_data, my_psb_data->header->signature, 4);
-    memcpy(&injected_psb_data[4], &my_psb_data->header->type, 4);
-    memcpy(&injected_psb_data[8], &my_psb_data->header->unknown1, 4);
-    memcpy(&injected_psb_data[12], &my_psb_data->header->offset_names, 4);
-    memcpy(&injected_psb_data[16], &my_psb_data->header->offset_strings, 4);
-    memcpy(&injected_psb_data[20], &my_psb_data->header->offset_strings_data, 4);
-    memcpy(&injected_psb_data[24], &my_psb_data->header->offset_chunk_offsets, 4);
-    memcpy(&injected_psb_data[28], &my_psb_data->header->offset_chunk_lengths, 4);
-    memcpy(&injected_psb_data[32], &my_psb_data->header->offset_chunk_data, 4);
-    memcpy(&injected_psb_data[36], &my_psb_data->header->offset_entries, 4);
+    int status;
+    while (waitpid(child, &status, 0) == -1 && errno == EINTR);
+    return WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS;
+}
 
-    if (debug_filewrites) {
-        FILE *debug_file = fopen("__injected_uncompressed_psb_data.psb", "wb");
-        if (debug_file == NULL) {
-            fprintf(stderr, "Error when opening injected psb output file.\n");
-            exit(EXIT_FAILURE);
+// Returns the loaded template for psb_name, (re)loading it if it isn't loaded or the psb.m changed since.
+// The daemon lock has to be held; it's released while the template loads, jobs for the same template wait for that load.
+// A template that fails to reload (the reason goes to the output of the daemon) stays as it was.
+static psb_data *get_daemon_template(const char *psb_name, char **message)
+{
+    struct _daemon_template *template = NULL;
+    for (int i = 0; i < daemon_state.template_amount && !template; i++) {
+        if (strcmp(daemon_state.templates[i]->psb_name, psb_name) == 0) {
+            template = daemon_state.templates[i];
         }
-        fwrite(injected_psb_data, injected_psb_data_size, 1, debug_file);
-        fclose(debug_file);
+    }
+    if (template == NULL) {
+        template = calloc(1, sizeof(struct _daemon_template));
+        template->psb_name = strdup(psb_name);
+        daemon_state.templates = realloc(daemon_state.templates, (daemon_state.template_amount + 1) * sizeof(struct _daemon_template *));
+        daemon_state.templates[daemon_state.template_amount++] = template;
+    }
+    while (template->loading && !daemon_state.stopped) {
+        pthread_cond_wait(&daemon_state.template_loaded, &daemon_state.lock);
+    }
+    if (daemon_state.stopped) {
+        *message = strdup("the daemon is stopping");
+        return NULL;
     }
 
-    uLongf compressed_size = compressBound(injected_psb_data_size);
-    Byte *compressed_injected_psb_data = malloc(8 + compressed_size);
-    memcpy(compressed_injected_psb_data, "mdf\x00", 4);
-    memcpy(&compressed_injected_psb_data[4], &injected_psb_data_size, 4);
-    int return_value = compress2(&compressed_injected_psb_data[8], &compressed_size, injected_psb_data, injected_psb_data_size, 9);
-    if (return_value != Z_OK) {
-        fprintf(stderr, "Error when compressing final psb.m file. The return code was %d. Will now exit.\n", return_value);
-        exit(EXIT_FAILURE);
+    struct stat psb_stat;
+    if (stat(psb_name, &psb_stat) != 0) {
+        *message = strdup("the template psb.m can't be accessed");
+        return NULL;
+    }
+    if (template->psb) {
+        psb_source *source = &template->psb->source;
+        if (source->size == (uint64_t) psb_stat.st_size && source->mtime_sec == psb_stat.st_mtim.tv_sec && source->mtime_nsec == psb_stat.st_mtim.tv_nsec) {
+            return template->psb;
+        }
     }
-    free(injected_psb_data);
 
-    printf("injected compressed psb size: %lu (+8 for the header)\n", compressed_size);
-    compressed_injected_psb_data = realloc(compressed_injected_psb_data, compressed_size + 8);
-    xor_data(&compressed_injected_psb_data[8], "alldata.psb.m", compressed_size);
+    template->loading = 1;
+    daemon_state.loading_templates++;
+    pthread_mutex_unlock(&daemon_state.lock);
 
-    FILE *out_psb_file = fopen(out_name, "wb");
-    if (out_psb_file == NULL) {
-        fprintf(stderr, "Couldn't open output file (%s). Will now terminate.", out_name);
-        exit(EXIT_FAILURE);
+    printf("%s template \"%s\".\n", template->psb ? "Reloading changed" : "Loading", psb_name);
+    pthread_rwlock_wrlock(&daemon_state.fork_lock);
+    psb_data *psb = try_load_from_psb(psb_name);
+    pthread_rwlock_unlock(&daemon_state.fork_lock);
+    if (psb == NULL) {
+        *message = strdup("the template couldn't be loaded, the daemon's output has the reason");
     }
 
-    fwrite(compressed_injected_psb_data, compressed_size + 8, 1, out_psb_file);
-    free(compressed_injected_psb_data);
-    fclose(out_psb_file);
+    pthread_mutex_lock(&daemon_state.lock);
+    if (psb) {
+        // children forked off the old one have their own copy of it
+        if (template->psb) {
+            free_psb_data(template->psb);
+        }
+        template->psb = psb;
+    }
+    template->loading = 0;
+    daemon_state.loading_templates--;
+    pthread_cond_broadcast(&daemon_state.template_loaded);
+    return psb;
 }
 
+struct _daemon_inject_job {
+    psb_data *template;
+    const char *rom_name;
+    const char *out_name;
+};
 
-psb_data *load_from_psb(const char *psb_filename)
+static void daemon_inject_job(void *context)
 {
-    FILE *in_psb_file = fopen(psb_filename, "rb");
-    if (in_psb_file == NULL) {
-        fprintf(stderr, "Error: file \"%s\" can't be accessed. Make sure it exists and is accessable.\n", psb_filename);
+    struct _daemon_inject_job *job = context;
+    local_thread_count = daemon_state.job_threads;
+    if (!run_injection(job->template, job->rom_name, NULL, 0, job->out_name, 0)) {
         exit(EXIT_FAILURE);
     }
+}
 
-    // figure out the length of the file, to allocate the exact amount of needed memory
-    fseek(in_psb_file, 0, SEEK_END);
-    int file_size = ftell(in_psb_file);
-    rewind(in_psb_file);
+// Runs one inject request and sends the response
+static void handle_inject_request(int client, const Byte *request, uint32_t length)
+{
+    // the three names have to be in there, all of them null terminated
+    const char *names[3];
+    uint32_t position = 1;
+    for (int i = 0; i < 3; i++) {
+        const Byte *end = position < length ? memchr(&request[position], '\0', length - position) : NULL;
+        if (end == NULL) {
+            send_response(client, 1, "malformed inject request");
+            return;
+        }
+        names[i] = (const char *) &request[position];
+        position = end - request + 1;
+    }
+    if (!has_psb_m_ending(names[2])) {
+        send_response(client, 1, "the output has to have a \".psb.m\" ending");
+        return;
+    }
 
-    Byte *file_contents = malloc(file_size);
-    assert(fread(file_contents, 1, file_size, in_psb_file) == file_size);
-    printf("original (compressed) psb size: %d\n", file_size);
-    fclose(in_psb_file); // contents read in, we no longer need the file stream
+    double start_time = get_seconds();
+    pthread_mutex_lock(&daemon_state.lock);
+    if (daemon_state.stopped) {
+        pthread_mutex_unlock(&daemon_state.lock);
+        send_response(client, 1, "the daemon is stopping");
+        return;
+    }
+    daemon_state.queued_jobs++;
+    while (daemon_state.running_jobs >= daemon_state.max_jobs) {
+        pthread_cond_wait(&daemon_state.job_finished, &daemon_state.lock);
+    }
+    daemon_state.queued_jobs--;
+    daemon_state.running_jobs++;
+    double queued_time = get_seconds() - start_time;
+
+    // the template is only used for the fork, which happens before the lock is released again
+    char *message = NULL;
+    _Bool success = 0;
+    pid_t child = -1;
+    int error_pipe;
+    struct _daemon_inject_job job = {NULL, names[1], names[2]};
+    while ((job.template = get_daemon_template(names[0], &message)) != NULL && pthread_rwlock_tryrdlock(&daemon_state.fork_lock) != 0) {
+        // some template is loading right now; that is waited for without the daemon lock, and as the template might
+        // have been reloaded in the meantime, it's looked up again afterwards
+        pthread_mutex_unlock(&daemon_state.lock);
+        pthread_rwlock_rdlock(&daemon_state.fork_lock);
+        pthread_rwlock_unlock(&daemon_state.fork_lock);
+        pthread_mutex_lock(&daemon_state.lock);
+    }
+    if (job.template) {
+        child = fork_job(daemon_inject_job, &job, &error_pipe);
+        pthread_rwlock_unlock(&daemon_state.fork_lock);
+        if (child == -1) {
+            message = strdup("couldn't start a process for the job");
+        }
+    }
+    pthread_mutex_unlock(&daemon_state.lock);
 
-    if (!(file_size >= 4 && memcmp(file_contents, "mdf\x00", 4) == 0)) {
-        fprintf(stderr, "Error: Input file does not have the correct signature.\n");
-        exit(EXIT_FAILURE);
+    if (child != -1) {
+        success = wait_for_job(child, error_pipe, &message);
+    }
+    double latency = get_seconds() - start_time;
+
+    pthread_mutex_lock(&daemon_state.lock);
+    daemon_state.running_jobs--;
+    daemon_state.finished_jobs++;
+    daemon_state.failed_jobs += !success;
+    daemon_state.total_latency += latency;
+    if (latency > daemon_state.max_latency) {
+        daemon_state.max_latency = latency;
+    }
+    pthread_cond_signal(&daemon_state.job_finished);
+    pthread_mutex_unlock(&daemon_state.lock);
+
+    printf("%s \"%s\" -> \"%s\" in %.1f ms (%.1f ms queued)\n", success ? "Injected" : "Failed to inject", names[1], names[2], latency * 1000, queued_time * 1000);
+    // the errors come at the end of what a job writes to stderr, so only that part is kept if it's too long for a frame
+    char *response = malloc(DAEMON_MAX_FRAME_SIZE);
+    if (success) {
+        sprintf(response, "injected in %.1f ms (%.1f ms queued)", latency * 1000, queued_time * 1000);
     } else {
-        printf("Signature correct.\n");
+        const char *error = message[0] ? message : "the job crashed";
+        size_t error_length = strlen(error);
+        const size_t max_error_length = DAEMON_MAX_FRAME_SIZE - 128;
+        _Bool truncated = error_length > max_error_length;
+        if (truncated) {
+            error += error_length - max_error_length;
+        }
+        sprintf(response, "failed after %.1f ms: %s%s", latency * 1000, truncated ? "..." : "", error);
     }
+    free(message);
+    send_response(client, !success, response);
+    free(response);
+}
 
-    // decrypt data
-    xor_data(&file_contents[8], psb_filename, file_size - 8);
-
-    // uncompress data
-    uLongf uncompressed_size = 0;
-    memcpy(&uncompressed_size, &file_contents[4], 4);
-
-    Byte *raw_psb_data = malloc(uncompressed_size);
-    int return_value = uncompress(raw_psb_data, &uncompressed_size, &file_contents[8], file_size - 8);
-    if (return_value != Z_OK) {
-        fprintf(stderr, "MAJOR error was occuring here; the entire uncompression failed.\n");
-        fprintf(stderr, "return_value: %d\n", return_value);
-        exit(EXIT_FAILURE);
+static void handle_stats_request(int client)
+{
+    char response[512];
+    pthread_mutex_lock(&daemon_state.lock);
+    int loaded_templates = 0;
+    for (int i = 0; i < daemon_state.template_amount; i++) {
+        loaded_templates += daemon_state.templates[i]->psb != NULL;
     }
-    printf("original uncompressed psb size: %ld\n", uncompressed_size);
-    free(file_contents);
+    sprintf(response, "running jobs: %d\nqueued jobs: %d\nfinished jobs: %"PRIu64" (%"PRIu64" failed)\naverage latency: %.1f ms\nmaximum latency: %.1f ms\nloaded templates: %d (%d loading)",
+        daemon_state.running_jobs, daemon_state.queued_jobs, daemon_state.finished_jobs, daemon_state.failed_jobs,
+        daemon_state.finished_jobs ? daemon_state.total_latency * 1000 / daemon_state.finished_jobs : 0.0, daemon_state.max_latency * 1000,
+        loaded_templates, daemon_state.loading_templates);
+    pthread_mutex_unlock(&daemon_state.lock);
+    send_response(client, 0, response);
+}
 
-    if (debug_filewrites) {
-        FILE *out_file = fopen("__original_uncompressed_psb_data.psb", "wb");
-        if (out_file == NULL) {
-            fprintf(stderr, "Error when opening uncompressed psb output file. Will now terminate.\n");
-            exit(EXIT_FAILURE);
+// Serves the requests of one client one after another, every client gets its own thread (see DAEMON_MAX_CLIENTS)
+static void *daemon_client_worker(void *argument)
+{
+    int client = (intptr_t) argument;
+    Byte *request;
+    uint32_t length;
+    while ((request = receive_frame(client, &length)) != NULL) {
+        if (length >= 1 && request[0] == DAEMON_REQUEST_INJECT) {
+            handle_inject_request(client, request, length);
+        } else if (length == 1 && request[0] == DAEMON_REQUEST_STATS) {
+            handle_stats_request(client);
+        } else {
+            send_response(client, 1, "unknown request");
         }
-        fwrite(raw_psb_data, uncompressed_size, 1, out_file);
-        fclose(out_file);
+        free(request);
     }
+    close(client);
 
-    // read in the psb header into our psb_header struct
-    psb_header *my_psb_header = malloc(sizeof(psb_header));
-    memcpy(&my_psb_header->signature, raw_psb_data, 4);
-    memcpy(&my_psb_header->type, &raw_psb_data[4], 4);
-    memcpy(&my_psb_header->unknown1, &raw_psb_data[8], 4);
-    memcpy(&my_psb_header->offset_names, &raw_psb_data[12], 4);
-    memcpy(&my_psb_header->offset_strings, &raw_psb_data[16], 4);
-    memcpy(&my_psb_header->offset_strings_data, &raw_psb_data[20], 4);
-    memcpy(&my_psb_header->offset_chunk_offsets, &raw_psb_data[24], 4);
-    memcpy(&my_psb_header->offset_chunk_lengths, &raw_psb_data[28], 4);
-    memcpy(&my_psb_header->offset_chunk_data, &raw_psb_data[32], 4);
-    memcpy(&my_psb_header->offset_entries, &raw_psb_data[36], 4);
-
-    // read in all psb data into our psb_data struct
-    psb_data *my_psb_data = malloc(sizeof(psb_data));
-    my_psb_data->header = my_psb_header;
-    original_psb_data *my_original_psb_data = malloc(sizeof(original_psb_data));
-    Byte *current_position = &raw_psb_data[my_psb_header->offset_names];
-    type_value *temp; // temporary buffer to avoid memory leaks
+    pthread_mutex_lock(&daemon_state.lock);
+    daemon_state.client_threads--;
+    pthread_cond_signal(&daemon_state.client_finished);
+    pthread_mutex_unlock(&daemon_state.lock);
+    return NULL;
+}
 
+static void stop_daemon(int signal_number)
+{
+    (void) signal_number;
+    daemon_stopping = 1;
+}
 
-    // unpack_names function
-    temp = extract_data(NULL, &current_position, NULL);
-    uint32_t *offsets = temp->value.integer_array;
-    free(temp);
-    temp = extract_data(NULL, &current_position, NULL);
-    uint32_t *jumps = temp->value.integer_array;
-    free(temp);
-    type_value *starts = extract_data(NULL, &current_position, NULL);
-
-    my_psb_data->names = malloc(starts->value_length * sizeof(char *));
-    char temp_string[255];
-    my_psb_data->names_amount = starts->value_length;
-
-    // not my algorithm, still have to understand what it does
-    if (debug) {
-        printf("Started deciphering the file names...\n");
+static int create_daemon_socket_address(const char *socket_name, struct sockaddr_un *address)
+{
+    memset(address, 0, sizeof(struct sockaddr_un));
+    address->sun_family = AF_UNIX;
+    if (strlen(socket_name) >= sizeof(address->sun_path)) {
+        fprintf(stderr, "Error: the socket path \"%s\" is too long.\n", socket_name);
+        exit(EXIT_FAILURE);
     }
-    for (int i = 0; i < starts->value_length; i++) {
-        uint32_t a = starts->value.integer_array[i];
-
-        int j;
-        for (j = 0; a != 0; j++) {
-            uint32_t b = jumps[a];
-            uint32_t c = offsets[b];
+    strcpy(address->sun_path, socket_name);
+    return socket(AF_UNIX, SOCK_STREAM, 0);
+}
 
-            int d = a - c;
-            if (d < 0) {
-                fprintf(stderr, "Error: this shouldn't happen.\n");
-                exit(EXIT_FAILURE);
+// Serves clients on socket_name until SIGINT or SIGTERM; max_jobs jobs run at the same time, the others wait in a queue.
+// The threads of the cpu get split between the jobs that run at the same time, like for batches.
+void run_daemon(const char *socket_name, int max_jobs)
+{
+    struct sockaddr_un address;
+    int listen_socket = create_daemon_socket_address(socket_name, &address);
+    unlink(socket_name); // left over by a daemon that didn't stop cleanly
+    if (listen_socket == -1 || bind(listen_socket, (struct sockaddr *) &address, sizeof(address)) != 0 || listen(listen_socket, 64) != 0) {
+        fprintf(stderr, "Error: can't listen on \"%s\": %s. Will now terminate.\n", socket_name, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    daemon_state.max_jobs = max_jobs;
+    daemon_state.job_threads = get_thread_count() > max_jobs ? get_thread_count() / max_jobs : 1;
+    pthread_atfork(lock_before_fork, unlock_after_fork, unlock_after_fork);
+
+    // no SA_RESTART, so accept gets interrupted by them
+    struct sigaction stop_action = {0};
+    stop_action.sa_handler = stop_daemon;
+    sigaction(SIGINT, &stop_action, NULL);
+    sigaction(SIGTERM, &stop_action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    printf("Listening on \"%s\", running up to %d job(s) at the same time.\n", socket_name, max_jobs);
+
+    while (!daemon_stopping) {
+        // a full house is checked for again every now and then, as the signals don't interrupt the wait
+        pthread_mutex_lock(&daemon_state.lock);
+        while (daemon_state.client_threads >= DAEMON_MAX_CLIENTS && !daemon_stopping) {
+            struct timespec timeout;
+            clock_gettime(CLOCK_REALTIME, &timeout);
+            timeout.tv_nsec += 100 * 1000 * 1000;
+            if (timeout.tv_nsec >= 1000 * 1000 * 1000) {
+                timeout.tv_sec++;
+                timeout.tv_nsec -= 1000 * 1000 * 1000;
             }
-            temp_string[j] = d;
-
-            a = b;
+            pthread_cond_timedwait(&daemon_state.client_finished, &daemon_state.lock, &timeout);
+        }
+        pthread_mutex_unlock(&daemon_state.lock);
+        if (daemon_stopping) {
+            break;
         }
 
-        my_psb_data->names[i] = malloc(j);
-        j--;
-        for (int k = j; j >= 0; j--) { // reverse the string and save it in the struct
-            my_psb_data->names[i][j] = temp_string[k-j];
+        int client = accept(listen_socket, NULL, NULL);
+        if (client == -1) {
+            continue;
         }
-        if (debug) {
-            printf("%03d: %s\n", i, my_psb_data->names[i]);
+        pthread_mutex_lock(&daemon_state.lock);
+        daemon_state.client_threads++;
+        pthread_mutex_unlock(&daemon_state.lock);
+        pthread_t worker;
+        if (pthread_create(&worker, NULL, daemon_client_worker, (void *) (intptr_t) client) != 0) {
+            close(client);
+            pthread_mutex_lock(&daemon_state.lock);
+            daemon_state.client_threads--;
+            pthread_mutex_unlock(&daemon_state.lock);
+            continue;
         }
+        pthread_detach(worker);
     }
-    // save the raw byte-data as raw_names for easier access when packing later
-    my_original_psb_data->raw_names_size = current_position - &raw_psb_data[my_psb_data->header->offset_names];
-    my_original_psb_data->raw_names = malloc(my_original_psb_data->raw_names_size);
-    memcpy(my_original_psb_data->raw_names, &raw_psb_data[my_psb_data->header->offset_names], my_original_psb_data->raw_names_size);
-    free(offsets);
-    free(jumps);
-    free(starts->value.integer_array);
-    free(starts);
 
-
-    // unpack_strings function
-    if (debug) {
-        printf("Started unpacking strings...\n");
+    close(listen_socket);
+    unlink(socket_name);
+    // loads that are still running finish first, jobs waiting for one get turned away
+    pthread_mutex_lock(&daemon_state.lock);
+    daemon_state.stopped = 1;
+    pthread_cond_broadcast(&daemon_state.template_loaded);
+    while (daemon_state.loading_templates) {
+        pthread_cond_wait(&daemon_state.template_loaded, &daemon_state.lock);
     }
-    current_position = &raw_psb_data[my_psb_data->header->offset_strings];
-    type_value *string_offsets = extract_data(NULL, &current_position, NULL);
-
-    current_position = &raw_psb_data[my_psb_data->header->offset_strings_data];
-    my_psb_data->strings = malloc(string_offsets->value_length * sizeof(char *));
-    my_psb_data->strings_amount = string_offsets->value_length;
-
-    for (int i = 0; i < string_offsets->value_length; i++) {
-        current_position = &raw_psb_data[my_psb_data->header->offset_strings_data] + string_offsets->value.integer_array[i];
-        my_psb_data->strings[i] = malloc(strlen((char *) current_position) + 1);
-        strcpy(my_psb_data->strings[i], (char *) current_position);
-        if (debug) {
-            printf("string at offset %d: \"%s\"\n", i,  my_psb_data->strings[i]);
+    for (int i = 0; i < daemon_state.template_amount; i++) {
+        free(daemon_state.templates[i]->psb_name);
+        if (daemon_state.templates[i]->psb) {
+            free_psb_data(daemon_state.templates[i]->psb);
         }
+        free(daemon_state.templates[i]);
     }
-    // save the raw byte-data as raw_strings for easier access when packing later
-    my_original_psb_data->raw_strings_size = current_position - &raw_psb_data[my_psb_data->header->offset_strings] + strlen((char *) current_position) + 1;
-    my_original_psb_data->raw_strings = malloc(my_original_psb_data->raw_strings_size);
-    memcpy(my_original_psb_data->raw_strings, &raw_psb_data[my_psb_data->header->offset_strings], my_original_psb_data->raw_strings_size);
-    free(string_offsets->value.integer_array);
-    free(string_offsets);
-
-
-    // unpack_chunks function
-    current_position = &raw_psb_data[my_psb_header->offset_chunk_offsets];
-    type_value *chunk_offsets = extract_data(NULL, &current_position, NULL);
-    my_psb_data->chunkdata_size = chunk_offsets->value_length;
-
-    current_position = &raw_psb_data[my_psb_header->offset_chunk_lengths];
-    type_value *chunk_lengths = extract_data(NULL, &current_position, NULL);
-
-    current_position = &raw_psb_data[my_psb_header->offset_chunk_data];
-    if (chunk_offsets->value_length == 0) {
-        my_psb_data->chunkdata = NULL;
-    }
-    for (int i = 0; i < chunk_offsets->value_length; i++) {
-        my_psb_data->chunkdata = malloc(chunk_lengths->value_length * sizeof(Byte *));
-        my_psb_data->chunkdata[i] = malloc(chunk_lengths->value.integer_array[i]);
-        memcpy(&my_psb_data->chunkdata[i], current_position, chunk_offsets->value.integer_array[i]);
-    }
-    free(chunk_lengths->value.integer_array);
-    free(chunk_lengths);
-    free(chunk_offsets->value.integer_array);
-    free(chunk_offsets);
-
-
-    // unpack_entries function
-    // takes around 0.1 seconds
-    current_position = &raw_psb_data[my_psb_header->offset_entries];
-    my_psb_data->entries = extract_data(my_psb_data, &current_position, NULL);
+    free(daemon_state.templates);
+    daemon_state.templates = NULL;
+    daemon_state.template_amount = 0;
+    pthread_mutex_unlock(&daemon_state.lock);
+    printf("Daemon stopped.\n");
+}
 
-    // Debug file_info output
-    if (debug) {
-        printf("file info before rom injection:\n");
-        for (int i = 0; i < my_psb_data->file_info_amount; i++) {
-            printf("file_info[%03d]: (name_index = %3u, offset = %8"PRIu64", length = %7"PRIu64"); string = \"%s\"\n", i, my_psb_data->file_info[i]->name_index, *my_psb_data->file_info[i]->offset, *my_psb_data->file_info[i]->length, my_psb_data->names[my_psb_data->file_info[i]->name_index]);
-        }
+// Sends a single request to the daemon and prints its response; returns the status of the response
+int run_client(const char *socket_name, const Byte *request, uint32_t length)
+{
+    struct sockaddr_un address;
+    int client = create_daemon_socket_address(socket_name, &address);
+    if (client == -1 || connect(client, (struct sockaddr *) &address, sizeof(address)) != 0) {
+        fprintf(stderr, "Error: can't connect to the daemon at \"%s\": %s.\n", socket_name, strerror(errno));
+        exit(EXIT_FAILURE);
     }
-
-    free(raw_psb_data);
-
-
-    // start reading in the bin file
-    int psb_filename_length = strlen(psb_filename);
-    char bin_name[psb_filename_length - 1];
-    memcpy(bin_name, psb_filename, psb_filename_length - 6);
-    strcpy(&bin_name[psb_filename_length - 6], ".bin");
-    printf("Reading in bin file \"%s\".\n", bin_name);
-
-    FILE *bin_file = fopen(bin_name, "rb");
-    if (bin_file == NULL) {
-        fprintf(stderr, "corresponding \".bin\" file doesn't exist. Imma just kill the program now.\n");
+    uint32_t response_length;
+    Byte *response = NULL;
+    if (!send_frame(client, request, length) || (response = receive_frame(client, &response_length)) == NULL || response_length < 1) {
+        fprintf(stderr, "Error: the daemon at \"%s\" didn't respond.\n", socket_name);
         exit(EXIT_FAILURE);
     }
+    close(client);
+    fprintf(response[0] ? stderr : stdout, "%s\n", (char *) &response[1]);
+    int status = response[0];
+    free(response);
+    return status;
+}
 
-    // read the bin data into the psb_data->subfile_data
-    my_psb_data->subfile_data = malloc(my_psb_data->file_info_amount * sizeof(Byte *));
-    for (int i = 0; i < my_psb_data->file_info_amount; i++) {
-        Byte *this_subfile_data = malloc(*my_psb_data->file_info[i]->length);
-        fseek(bin_file, *my_psb_data->file_info[i]->offset, SEEK_SET);
-        assert(fread(this_subfile_data, 1, *my_psb_data->file_info[i]->length, bin_file) == *my_psb_data->file_info[i]->length);
-        my_psb_data->subfile_data[i] = this_subfile_data;
+// The daemon has its own working directory, so relative paths are made absolute before sending them; returns the new end of request
+static Byte *append_absolute_path(Byte *request, const char *path, const char *working_directory)
+{
+    if (path[0] != '/') {
+        request += sprintf((char *) request, "%s/", working_directory);
     }
-    fclose(bin_file);
-
-    my_psb_data->raw_psb_data = my_original_psb_data;
-    return my_psb_data;
+    return (Byte *) stpcpy((char *) request, path) + 1;
 }
 
 
-void read_rom(psb_data *my_psb_data, const char *rom_name)
+void print_usage(void)
 {
-    printf("Reading in rom file \"%s\".\n", rom_name);
+    printf("Syntax: ./psb.exe [options] <psb.m to inject into> <rom to inject> <output psb.m>\n");
+    printf("        ./psb.exe --replace <name>=<file> [...] <psb.m to inject into> [rom to inject] <output psb.m>\n");
+    printf("        ./psb.exe --batch <manifest> [--replace <name>=<file> ...] [psb.m to inject into]\n");
+    printf("        ./psb.exe --in-place [--replace <name>=<file> ...] <psb.m to inject into> [rom to inject]\n");
+    printf("        ./psb.exe --list <prefix> <psb.m>\n");
+    printf("        ./psb.exe --extract <directory> <psb.m>\n");
+    printf("        ./psb.exe --daemon <socket> [--jobs N]\n");
+    printf("        ./psb.exe --client <socket> <psb.m to inject into> <rom to inject> <output psb.m>\n");
+    printf("        ./psb.exe --client <socket> --stats\n");
+    printf("Options:\n");
+    printf("  --threads N              use N threads for compression (default: one per cpu core)\n");
+    printf("  --cache <directory>      cache compressed roms (and other replaced subfiles) in directory, so the same file\n");
+    printf("                           never has to be compressed twice\n");
+    printf("  --cache-size <MiB>       size limit of the cache, the least recently used files get removed (default: 1024)\n");
+    printf("  --snapshot               keep a snapshot of the parsed psb.m next to it (<psb.m>.snapshot) and load that\n");
+    printf("                           instead as long as the psb.m doesn't change\n");
+    printf("  --replace <name>=<file>  replace the subfile called name with file, can be given more than once\n");
+    printf("  --in-place               write into the psb.m itself; if the new subfiles fit where the old ones were, only they\n");
+    printf("                           get written into the bin instead of rewriting it as a whole (not safe against crashes)\n");
+    printf("  --list <prefix>          list all subfiles whose name starts with prefix (\"\" for all of them)\n");
+    printf("  --extract <directory>    write all subfiles (uncompressed) to directory, using their names as paths\n");
+    printf("  --batch <manifest>       inject every rom of the manifest, which has one \"[<psb.m><tab>]<rom><tab><output psb.m>\"\n");
+    printf("                           per line (without a psb.m the one from the command line is used); the jobs run at\n");
+    printf("                           the same time and every psb.m is only loaded once\n");
+    printf("  --memory-budget <MiB>    memory the batch jobs may use at the same time (default: half of the physical memory)\n");
+    printf("  --daemon <socket>        keep loaded psb.m files in memory and run the jobs sent to socket by --client\n");
+    printf("  --jobs N                 amount of jobs the daemon runs at the same time (default: one per cpu core)\n");
+    printf("  --client <socket>        let the daemon listening on socket do the injection\n");
+    printf("  --stats                  with --client: print the job statistics of the daemon\n");
+    printf("  --benchmark-xor          only measure the speed of the xor kernels and exit\n");
+}
 
-    for (int i = 0; i < my_psb_data->file_info_amount; i++) {
-        char *current_name = my_psb_data->names[my_psb_data->file_info[i]->name_index];
-        if (strncmp(current_name, "system/roms/", 12) == 0) {
-            // replace that (rom) subfile with the rom to inject
 
-            FILE *in_rom_file = fopen(rom_name, "rb");
-            if (in_rom_file == NULL) {
-                fprintf(stderr, "um idk what the fuck but that rom file can not be loaded in.\n");
-                exit(EXIT_FAILURE);
+int main(int argc, char **argv)
+{
+    const char *positional_arguments[3];
+    int positional_amount = 0;
+    const char *list_prefix = NULL;
+    const char *extract_directory = NULL;
+    const char *manifest_name = NULL;
+    const char *daemon_socket = NULL;
+    const char *client_socket = NULL;
+    _Bool stats = 0;
+    _Bool in_place = 0;
+    int max_jobs = 0;
+    long physical_pages = sysconf(_SC_PHYS_PAGES);
+    uint64_t memory_budget = physical_pages > 0 ? (uint64_t) physical_pages * sysconf(_SC_PAGESIZE) / 2 : (uint64_t) 1024 * 1024 * 1024;
+    char *replacements[argc]; // "name=file"
+    int replacement_amount = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--list") == 0) {
+            if (i + 1 >= argc) {
+                printf("--list needs a prefix.\n");
+                exit(0);
             }
-
-            // figure out the length of the file, to allocate the exact amount of needed memory
-            fseek(in_rom_file, 0, SEEK_END);
-            int file_size = ftell(in_rom_file);
-            rewind(in_rom_file);
-            printf("file size of rom: %d\n", file_size);
-
-            uLongf final_size = compressBound(file_size);
-            if (final_size + 8 > *my_psb_data->file_info[i]->length) { // need to realloc to make absolutely sure we compress only to initialized memory
-                my_psb_data->subfile_data[i] = realloc(my_psb_data->subfile_data[i], final_size + 8 + 32 * 1024);
-                /* give me some time to explain the "32 * 1024". zlib's compression method (for some reason that I don't know)
-                   always only needs the last 32k bytes of the data to know how to compress the current data. If I didn't allocate the extra 32kb,
-                   zlib would always overwrite data that it later uses again, resulting in compressed data being read instead of just the uncompressed one.
-                   But I don't want to allocate the entire "file_size" in bytes, as that will be multiple megabytes. Temporarily allocating additional 32kb
-                   is much more efficient and should (given that my previous statements are correct) ALWAYS work flawlessly; without any risk of dirty reads.
-                */
+            list_prefix = argv[++i];
+        } else if (strcmp(argv[i], "--extract") == 0) {
+            if (i + 1 >= argc) {
+                printf("--extract needs a directory.\n");
+                exit(0);
             }
-            assert(fread(&my_psb_data->subfile_data[i][32*1024], 1, file_size, in_rom_file) == file_size);
-            fclose(in_rom_file); // contents read in, we no longer need the file stream
-
-            printf("Started compressing rom file...\n");
-            int return_value = compress2(&my_psb_data->subfile_data[i][8], &final_size, &my_psb_data->subfile_data[i][32*1024], file_size, 9); // tricky, but works
-            if (return_value != Z_OK) {
-                fprintf(stderr, "Error when compressing rom file. The return code was %d. Will now exit.\n", return_value);
-                exit(EXIT_FAILURE);
+            extract_directory = argv[++i];
+        } else if (strcmp(argv[i], "--batch") == 0) {
+            if (i + 1 >= argc) {
+                printf("--batch needs a manifest file.\n");
+                exit(0);
             }
-            printf("Rom compression finished.\n");
-            printf("compressed rom size: %lu\n", final_size);
-            my_psb_data->subfile_data[i] = realloc(my_psb_data->subfile_data[i], final_size + 8); // will probably be much lower, so we save space
-            memcpy(my_psb_data->subfile_data[i], "mdf\x00", 4);
-            memcpy(&my_psb_data->subfile_data[i][4], &file_size, 4);
-
-            xor_data(&my_psb_data->subfile_data[i][8], current_name, final_size);
-            *my_psb_data->file_info[i]->length = final_size + 8; // all offsets are potentially broken rn, so we need to fix them up below
-
-            break;
+            manifest_name = argv[++i];
+        } else if (strcmp(argv[i], "--replace") == 0) {
+            if (i + 1 >= argc || strchr(argv[i+1], '=') == NULL) {
+                printf("--replace needs an argument in the form <name>=<file>.\n");
+                exit(0);
+            }
+            replacements[replacement_amount++] = argv[++i];
+        } else if (strcmp(argv[i], "--threads") == 0) {
+            if (i + 1 >= argc || atoi(argv[i+1]) <= 0) {
+                printf("--threads needs a positive number of threads.\n");
+                exit(0);
+            }
+            thread_count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--cache") == 0) {
+            if (i + 1 >= argc) {
+                printf("--cache needs a directory.\n");
+                exit(0);
+            }
+            cache_directory = argv[++i];
+        } else if (strcmp(argv[i], "--cache-size") == 0) {
+            if (i + 1 >= argc || atoll(argv[i+1]) <= 0) {
+                printf("--cache-size needs a positive size in MiB.\n");
+                exit(0);
+            }
+            cache_size_limit = (uint64_t) atoll(argv[++i]) * 1024 * 1024;
+        } else if (strcmp(argv[i], "--snapshot") == 0) {
+            use_snapshots = 1;
+        } else if (strcmp(argv[i], "--daemon") == 0 || strcmp(argv[i], "--client") == 0) {
+            if (i + 1 >= argc) {
+                printf("%s needs a socket path.\n", argv[i]);
+                exit(0);
+            }
+            *(argv[i][2] == 'd' ? &daemon_socket : &client_socket) = argv[i+1];
+            i++;
+        } else if (strcmp(argv[i], "--memory-budget") == 0) {
+            if (i + 1 >= argc || atoll(argv[i+1]) <= 0) {
+                printf("--memory-budget needs a positive size in MiB.\n");
+                exit(0);
+            }
+            memory_budget = (uint64_t) atoll(argv[++i]) * 1024 * 1024;
+        } else if (strcmp(argv[i], "--jobs") == 0) {
+            if (i + 1 >= argc || atoi(argv[i+1]) <= 0) {
+                printf("--jobs needs a positive number of jobs.\n");
+                exit(0);
+            }
+            max_jobs = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            stats = 1;
+        } else if (strcmp(argv[i], "--in-place") == 0) {
+            in_place = 1;
+        } else if (strcmp(argv[i], "--benchmark-xor") == 0) {
+            benchmark_xor();
+            exit(0);
+        } else if (strncmp(argv[i], "--", 2) == 0 || positional_amount == 3) {
+            print_usage();
+            exit(0);
+        } else {
+            positional_arguments[positional_amount++] = argv[i];
         }
     }
 
-    for (int i = 0; i < my_psb_data->file_info_amount - 1; i++) {
-        uint64_t next_offset = *my_psb_data->file_info[i+1]->offset;
+    if (daemon_socket) {
+        if (positional_amount != 0) {
+            print_usage();
+            exit(0);
+        }
+        run_daemon(daemon_socket, max_jobs ? max_jobs : get_thread_count());
+        free_xor_key_cache();
+        return 0;
+    }
 
-        // our current offset is already correct because of the last pass (or it's 0, which is always correct)
-        uint64_t potential_next_offset = *my_psb_data->file_info[i]->offset + *my_psb_data->file_info[i]->length;
-        if (next_offset < potential_next_offset || potential_next_offset + 2048 <= next_offset) {
-            // 1. the next offset will have to be bumped, the current length is too high to fit ||
-            // 2. the next offset will have to be lowered, it's too high for our smaller length
+    if (client_socket) {
+        if (stats && positional_amount == 0) {
+            Byte request = DAEMON_REQUEST_STATS;
+            return run_client(client_socket, &request, 1) ? EXIT_FAILURE : 0;
+        }
+        if (stats || positional_amount != 3) {
+            print_usage();
+            exit(0);
+        }
+        char working_directory[PATH_MAX];
+        if (getcwd(working_directory, PATH_MAX) == NULL) {
+            fprintf(stderr, "Error: can't get the working directory.\n");
+            exit(EXIT_FAILURE);
+        }
+        size_t request_size = 1;
+        for (int i = 0; i < 3; i++) {
+            request_size += strlen(working_directory) + strlen(positional_arguments[i]) + 2;
+        }
+        Byte request[request_size];
+        request[0] = DAEMON_REQUEST_INJECT;
+        Byte *request_end = &request[1];
+        for (int i = 0; i < 3; i++) {
+            request_end = append_absolute_path(request_end, positional_arguments[i], working_directory);
+        }
+        return run_client(client_socket, request, request_end - request) ? EXIT_FAILURE : 0;
+    }
 
-            if (potential_next_offset % 2048 == 0) {
-                *my_psb_data->file_info[i+1]->offset = potential_next_offset;
-            } else {
-                *my_psb_data->file_info[i+1]->offset = ((potential_next_offset / 2048) + 1) * 2048;
-            }
+    if (extract_directory) {
+        if (positional_amount != 1) {
+            print_usage();
+            exit(0);
         }
+        psb_data *mypsb = load_from_psb(positional_arguments[0]);
+        int failed_subfiles = extract_subfiles(mypsb, extract_directory);
+        free_psb_data(mypsb);
+        free_xor_key_cache();
+        return failed_subfiles ? EXIT_FAILURE : 0;
     }
 
-    // Debug file_info output
-    if (debug) {
-        printf("file info after rom injection:\n");
-        for (int i = 0; i < my_psb_data->file_info_amount; i++) {
-            printf("file_info[%03d]: (name_index = %3u, offset = %8"PRIu64", length = %7"PRIu64"); string = \"%s\"\n", i, my_psb_data->file_info[i]->name_index, *my_psb_data->file_info[i]->offset, *my_psb_data->file_info[i]->length, my_psb_data->names[my_psb_data->file_info[i]->name_index]);
+    if (list_prefix) {
+        if (positional_amount != 1) {
+            print_usage();
+            exit(0);
         }
+        // the loader reports its progress on stdout, which only gets the listing here, so it can be piped somewhere
+        fflush(stdout);
+        int listing_output = dup(STDOUT_FILENO);
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+        psb_data *mypsb = load_from_psb(positional_arguments[0]);
+        fflush(stdout);
+        dup2(listing_output, STDOUT_FILENO);
+        close(listing_output);
+        uint32_t first;
+        uint32_t amount = find_file_info_prefix(mypsb, list_prefix, &first);
+        for (uint32_t i = first; i < first + amount; i++) {
+            int index = mypsb->file_info_by_name[i];
+            printf("%10"PRIu64" %10"PRIu64"  %s\n", get_file_info_offset(mypsb, index), get_file_info_length(mypsb, index), mypsb->names[mypsb->file_info[index].name_index]);
+        }
+        free_psb_data(mypsb);
+        free_xor_key_cache();
+        return 0;
     }
-}
 
+    if (manifest_name) {
+        if (positional_amount > 1) {
+            print_usage();
+            exit(0);
+        }
+        int job_amount;
+        batch_job *jobs = read_manifest(manifest_name, &job_amount);
+        int failed_jobs = run_batch(jobs, job_amount, positional_amount ? positional_arguments[0] : NULL, replacements, replacement_amount, memory_budget);
+        for (int i = 0; i < job_amount; i++) {
+            free(jobs[i].psb_name);
+            free(jobs[i].rom_name);
+            free(jobs[i].out_name);
+        }
+        free(jobs);
+        free_xor_key_cache();
+        return failed_jobs ? EXIT_FAILURE : 0;
+    }
 
-int main(int argc, char **argv)
-{
-    if (argc != 4) {
-        printf("Syntax: ./psb.exe <psb.m to inject into> <rom to inject> <output psb.m>\n");
+    // the rom is optional when there are other subfiles to replace; in place, the psb.m is the output as well
+    int output_amount = in_place ? 0 : 1;
+    if (positional_amount != 2 + output_amount && !(replacement_amount && positional_amount == 1 + output_amount)) {
+        print_usage();
         exit(0);
     }
-    if (strlen(argv[3]) < 6 || strcmp(&argv[3][strlen(argv[3]) - 6], ".psb.m") != 0) {
+    const char *rom_name = positional_amount == 2 + output_amount ? positional_arguments[1] : NULL;
+    const char *out_name = in_place ? positional_arguments[0] : positional_arguments[positional_amount - 1];
+    if (!has_psb_m_ending(out_name)) {
         printf("Please just use files with a \".psb.m\" ending for now.\n");
         exit(0);
     }
 
-    psb_data *mypsb = load_from_psb(argv[1]);
+    psb_data *mypsb = load_from_psb(positional_arguments[0]);
 
-    read_rom(mypsb, argv[2]);
+    subfile_replacement parsed_replacements[replacement_amount + 1];
+    for (int i = 0; i < replacement_amount; i++) {
+        char *separator = strchr(replacements[i], '=');
+        *separator = '\0';
+        parsed_replacements[i].index = find_file_info(mypsb, replacements[i]);
+        parsed_replacements[i].file_name = separator + 1;
+        if (parsed_replacements[i].index == -1) {
+            fprintf(stderr, "Error: the psb doesn't contain a subfile called \"%s\". Will now terminate.\n", replacements[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
 
-    pack_psb(mypsb, argv[3]);
-    pack_bin(mypsb, argv[3]);
+    if (!run_injection(mypsb, rom_name, parsed_replacements, replacement_amount, out_name, in_place)) {
+        fprintf(stderr, "The injection failed. Will now terminate.\n");
+        exit(EXIT_FAILURE);
+    }
 
     printf("Injection finished.\n");
     free_psb_data(mypsb);
+    free_xor_key_cache();
 }